@@ -0,0 +1,334 @@
+#include "SC16IS740RK.h"
+
+// Pick a debug level from one of these two:
+SerialLogHandler logHandler;
+// SerialLogHandler logHandler(LOG_LEVEL_TRACE);
+
+SYSTEM_THREAD(ENABLED);
+
+// Connect the Photon TX pin to the SC16IS740 RX pin
+// Connect the Photon RX pin to the SC16IS740 TX pin
+//
+// This sketch measures sustained throughput, bus utilization, bus transactions per byte, and
+// write-to-wire latency across baud rates, bus speeds, and write chunk sizes. Results are logged
+// one line per configuration so they can be captured from the USB serial port and compared
+// between library versions.
+//
+// The I2C transport is swept over I2C speeds and the SPI transport over SPI clock speeds. Set
+// BENCH_I2C and BENCH_SPI to match how your SC16IS740 is connected.
+//
+// The same sweep runs on a computer against the SC16IS740Sim timing model as part of the host tests
+// (see test/ and "Host Tests" in the README), with limits on transactions per byte and elapsed time.
+//
+// Receive is measured once per configuration rather than per chunk size, because the library
+// always drains the whole RX FIFO into its receive buffer; the size passed to read() only changes
+// how the data is copied out of RAM, not the bus traffic.
+
+// Set this to the oscillator on your board. Baud rates that can't be generated are skipped.
+const int OSCILLATOR_HZ = 1843200;
+
+const bool BENCH_I2C = true;
+const bool BENCH_SPI = false;
+
+// Wraps a transport (SC16IS740 or SC16IS740SPI) to count bus transactions and the time spent in them
+template<class Port>
+class BenchPort : public Port {
+public:
+	template<typename... Args>
+	BenchPort(Args&&... args) : Port(std::forward<Args>(args)...) {};
+
+	virtual uint8_t readRegister(uint8_t reg) {
+		unsigned long start = micros();
+		uint8_t value = Port::readRegister(reg);
+		busMicros += micros() - start;
+		transactions++;
+		return value;
+	}
+
+	virtual bool writeRegister(uint8_t reg, uint8_t value) {
+		unsigned long start = micros();
+		bool result = Port::writeRegister(reg, value);
+		busMicros += micros() - start;
+		transactions++;
+		return result;
+	}
+
+	void resetCounts() {
+		transactions = 0;
+		busMicros = 0;
+	}
+
+	unsigned long transactions = 0;
+	unsigned long busMicros = 0;
+
+protected:
+	virtual bool readInternal(uint8_t *buffer, size_t size) {
+		unsigned long start = micros();
+		bool result = Port::readInternal(buffer, size);
+		busMicros += micros() - start;
+		transactions++;
+		return result;
+	}
+
+	virtual bool writeInternal(const uint8_t *buffer, size_t size) {
+		unsigned long start = micros();
+		bool result = Port::writeInternal(buffer, size);
+		busMicros += micros() - start;
+		transactions++;
+		return result;
+	}
+
+	virtual bool writeInternalVec(const SC16IS740Base::WriteVec *vec, size_t count) {
+		unsigned long start = micros();
+		bool result = Port::writeInternalVec(vec, count);
+		busMicros += micros() - start;
+		transactions++;
+		return result;
+	}
+};
+
+BenchPort<SC16IS740> i2cSerial(Wire, 0);
+BenchPort<SC16IS740SPI> spiSerial(SPI, A2);
+
+int bauds[] = { 1200, 9600, 19200, 57600, 115200, 230400, 460800, 921600 };
+
+uint32_t i2cSpeeds[] = { CLOCK_SPEED_100KHZ, CLOCK_SPEED_400KHZ, 1000000 };
+
+uint8_t spiClockSpeedsMHz[] = { 1, 4, 8, 15 };
+
+size_t chunkSizes[] = { 1, 8, 16, 32, 64 };
+
+const size_t NUM_LATENCY_SAMPLES = 100;
+unsigned long latencySamples[NUM_LATENCY_SAMPLES];
+
+uint8_t tempBuf[4096];
+
+void runBenchmark();
+
+void setup() {
+	Serial.begin(9600);
+
+	delay(5000);
+
+	i2cSerial.withOscillatorHz(OSCILLATOR_HZ);
+	i2cSerial.blockOnOverrun(false);
+	spiSerial.withOscillatorHz(OSCILLATOR_HZ);
+	spiSerial.blockOnOverrun(false);
+}
+
+void loop() {
+	runBenchmark();
+	delay(60000);
+}
+
+template<class Port>
+void clearAvailable(BenchPort<Port> &port) {
+	while(Serial1.available()) {
+		Serial1.read();
+	}
+	while(port.available()) {
+		port.read();
+	}
+}
+
+// Size of the test transfer, scaled so each test takes about 2 seconds of wire time
+size_t testSize(int baud) {
+	size_t size = (size_t) (baud / 10) * 2;
+	if (size < 64) {
+		size = 64;
+	}
+	if (size > sizeof(tempBuf)) {
+		size = sizeof(tempBuf);
+	}
+	return size;
+}
+
+// bus is "i2c" or "spi" and busSpeed is the I2C or SPI clock in Hz. chunk is 0 for tests without a chunk size.
+template<class Port>
+void logResult(BenchPort<Port> &port, const char *test, int baud, const char *bus, uint32_t busSpeed, size_t chunk, size_t size, unsigned long elapsedMs) {
+	if (elapsedMs == 0) {
+		elapsedMs = 1;
+	}
+	unsigned long bytesPerSec = (unsigned long) size * 1000 / elapsedMs;
+	unsigned long wirePct = bytesPerSec * 1000 / (baud / 10); // tenths of a percent of line rate
+	unsigned long busPct = port.busMicros / elapsedMs; // tenths of a percent of elapsed time
+	unsigned long tpkb = port.transactions * 1000 / size; // transactions per 1000 bytes
+
+	Log.info("%s baud=%d %s=%lu chunk=%u bytes=%u ms=%lu bytesPerSec=%lu lineRate=%lu.%lu%% busUtil=%lu.%lu%% transPer1000Bytes=%lu",
+		test, baud, bus, busSpeed, chunk, size, elapsedMs, bytesPerSec, wirePct / 10, wirePct % 10, busPct / 10, busPct % 10, tpkb);
+}
+
+template<class Port>
+bool benchTransmit(BenchPort<Port> &port, int baud, const char *bus, uint32_t busSpeed, size_t chunk) {
+	size_t size = testSize(baud);
+
+	for(size_t ii = 0; ii < size; ii++) {
+		tempBuf[ii] = (uint8_t) rand();
+	}
+
+	clearAvailable(port);
+	port.resetCounts();
+
+	size_t writeIndex = 0;
+	size_t readIndex = 0;
+	unsigned long start = millis();
+
+	while(readIndex < size) {
+		if (writeIndex < size) {
+			size_t count = size - writeIndex;
+			if (count > chunk) {
+				count = chunk;
+			}
+			// With blockOnOverrun(false), write() returns how much fit in the TX FIFO
+			writeIndex += port.write(&tempBuf[writeIndex], count);
+		}
+
+		while(Serial1.available()) {
+			int c = Serial1.read();
+			if (c != tempBuf[readIndex]) {
+				Log.error("benchTransmit mismatch baud=%d chunk=%u index=%u got=%02x expected=%02x", baud, chunk, readIndex, c, tempBuf[readIndex]);
+				return false;
+			}
+			readIndex++;
+		}
+
+		if (millis() - start >= 30000) {
+			Log.error("benchTransmit timeout baud=%d chunk=%u readIndex=%u", baud, chunk, readIndex);
+			return false;
+		}
+	}
+
+	logResult(port, "tx", baud, bus, busSpeed, chunk, size, millis() - start);
+	return true;
+}
+
+template<class Port>
+bool benchReceive(BenchPort<Port> &port, int baud, const char *bus, uint32_t busSpeed) {
+	size_t size = testSize(baud);
+
+	for(size_t ii = 0; ii < size; ii++) {
+		tempBuf[ii] = (uint8_t) rand();
+	}
+
+	clearAvailable(port);
+	port.resetCounts();
+
+	size_t writeIndex = 0;
+	size_t readIndex = 0;
+	unsigned long start = millis();
+
+	while(readIndex < size) {
+		// Don't fill the entire send FIFO as data may be lost because the send and receive FIFOs are
+		// both 64 bytes
+		while(writeIndex < size && Serial1.availableForWrite() > 32) {
+			Serial1.write(tempBuf[writeIndex++]);
+		}
+
+		uint8_t buf[64];
+		int count = port.read(buf, sizeof(buf));
+		for(int jj = 0; jj < count; jj++) {
+			if (buf[jj] != tempBuf[readIndex]) {
+				Log.error("benchReceive mismatch baud=%d index=%u got=%02x expected=%02x", baud, readIndex, buf[jj], tempBuf[readIndex]);
+				return false;
+			}
+			readIndex++;
+		}
+
+		if (millis() - start >= 30000) {
+			Log.error("benchReceive timeout baud=%d readIndex=%u", baud, readIndex);
+			return false;
+		}
+	}
+
+	logResult(port, "rx", baud, bus, busSpeed, 0, size, millis() - start);
+	return true;
+}
+
+int compareUnsignedLong(const void *a, const void *b) {
+	unsigned long aa = *(const unsigned long *)a;
+	unsigned long bb = *(const unsigned long *)b;
+	return (aa < bb) ? -1 : ((aa > bb) ? 1 : 0);
+}
+
+// Time from write() of a single byte on an idle line until it arrives on Serial1. This includes
+// one character time on the wire and the Serial1 receive latency.
+template<class Port>
+bool benchLatency(BenchPort<Port> &port, int baud, const char *bus, uint32_t busSpeed) {
+	clearAvailable(port);
+
+	for(size_t ii = 0; ii < NUM_LATENCY_SAMPLES; ii++) {
+		uint8_t c = (uint8_t) ii;
+
+		unsigned long start = micros();
+		port.write(c);
+		while(!Serial1.available()) {
+			if (micros() - start > 1000000) {
+				Log.error("benchLatency timeout baud=%d sample=%u", baud, ii);
+				return false;
+			}
+		}
+		latencySamples[ii] = micros() - start;
+		Serial1.read();
+	}
+
+	qsort(latencySamples, NUM_LATENCY_SAMPLES, sizeof(latencySamples[0]), compareUnsignedLong);
+
+	// Nearest-rank percentiles: p99 is the smallest sample at or above 99% of the samples
+	Log.info("latency baud=%d %s=%lu p50=%luus p99=%luus max=%luus", baud, bus, busSpeed,
+		latencySamples[NUM_LATENCY_SAMPLES / 2], latencySamples[(NUM_LATENCY_SAMPLES * 99 + 99) / 100 - 1], latencySamples[NUM_LATENCY_SAMPLES - 1]);
+	return true;
+}
+
+// Runs every test at every baud rate the oscillator supports, at the bus speed already applied to port
+template<class Port>
+void benchBauds(BenchPort<Port> &port, const char *bus, uint32_t busSpeed) {
+	for(size_t ii = 0; ii < sizeof(bauds) / sizeof(bauds[0]); ii++) {
+		if (!SC16IS740Base::isBaudValid(OSCILLATOR_HZ, bauds[ii])) {
+			// Not possible with this oscillator
+			continue;
+		}
+
+		Serial1.begin(bauds[ii]);
+		port.begin(bauds[ii]);
+		delay(10);
+
+		for(size_t cc = 0; cc < sizeof(chunkSizes) / sizeof(chunkSizes[0]); cc++) {
+			benchTransmit(port, bauds[ii], bus, busSpeed, chunkSizes[cc]);
+		}
+		benchReceive(port, bauds[ii], bus, busSpeed);
+		benchLatency(port, bauds[ii], bus, busSpeed);
+	}
+}
+
+void runBenchmark() {
+	Log.info("runBenchmark");
+
+	srand(0);
+
+	if (BENCH_I2C) {
+		for(size_t ss = 0; ss < sizeof(i2cSpeeds) / sizeof(i2cSpeeds[0]); ss++) {
+			// Wire.setSpeed() only takes effect before Wire.begin(), which begin() calls
+			Wire.end();
+			Wire.setSpeed(i2cSpeeds[ss]);
+			benchBauds(i2cSerial, "i2c", i2cSpeeds[ss]);
+		}
+
+		Wire.end();
+		Wire.setSpeed(CLOCK_SPEED_100KHZ);
+		i2cSerial.begin(9600);
+	}
+
+	if (BENCH_SPI) {
+		for(size_t ss = 0; ss < sizeof(spiClockSpeedsMHz) / sizeof(spiClockSpeedsMHz[0]); ss++) {
+			// The SPI clock is applied in begin()
+			spiSerial.withSpiClockSpeedMHz(spiClockSpeedsMHz[ss]);
+			benchBauds(spiSerial, "spi", (uint32_t) spiClockSpeedsMHz[ss] * 1000000);
+		}
+
+		spiSerial.withSpiClockSpeedMHz(4);
+		spiSerial.begin(9600);
+	}
+
+	Serial1.begin(9600);
+	Log.info("runBenchmark completed");
+}
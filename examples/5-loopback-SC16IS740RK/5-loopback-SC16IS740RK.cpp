@@ -0,0 +1,72 @@
+#include "SC16IS740RK.h"
+
+// Pick a debug level from one of these two:
+SerialLogHandler logHandler;
+// SerialLogHandler logHandler(LOG_LEVEL_TRACE);
+
+SYSTEM_THREAD(ENABLED);
+
+// No external wiring is needed. This sketch uses the SC16IS740 internal loopback (MCR[4]) to
+// measure verified throughput, round-trip latency, and errors at every baud rate the oscillator
+// supports and each I2C speed, then logs one line per configuration. Nothing is sent on the TX pin.
+
+// Set this to the oscillator on your board. Baud rates that can't be generated are skipped.
+const int OSCILLATOR_HZ = 1843200;
+
+SC16IS740 extSerial(Wire, 0);
+
+int bauds[] = { 1200, 9600, 19200, 57600, 115200, 230400, 460800, 921600 };
+
+uint32_t i2cSpeeds[] = { CLOCK_SPEED_100KHZ, CLOCK_SPEED_400KHZ, 1000000 };
+
+void runLoopbackTests();
+
+void setup() {
+	Serial.begin(9600);
+
+	delay(5000);
+
+	extSerial.withOscillatorHz(OSCILLATOR_HZ).begin(9600);
+}
+
+void loop() {
+	runLoopbackTests();
+	delay(60000);
+}
+
+void runLoopbackTests() {
+	Log.info("runLoopbackTests");
+
+	size_t failures = 0;
+
+	for(size_t ss = 0; ss < sizeof(i2cSpeeds) / sizeof(i2cSpeeds[0]); ss++) {
+		// Wire.setSpeed() only takes effect before Wire.begin(), which extSerial.begin() calls
+		Wire.end();
+		Wire.setSpeed(i2cSpeeds[ss]);
+		extSerial.begin(9600);
+
+		for(size_t ii = 0; ii < sizeof(bauds) / sizeof(bauds[0]); ii++) {
+			if (!SC16IS740Base::isBaudValid(OSCILLATOR_HZ, bauds[ii])) {
+				// Not possible with this oscillator
+				continue;
+			}
+
+			// About one second of wire time
+			size_t size = bauds[ii] / 10;
+
+			SC16IS740LoopbackResult result;
+			if (!extSerial.runLoopbackTest(bauds[ii], size, result)) {
+				failures++;
+			}
+
+			Log.info("loopback baud=%d actual=%d i2c=%lu bytes=%lu verified=%lu errors=%lu lineErrors=%lu ms=%lu bytesPerSec=%lu rtt min=%luus avg=%luus max=%luus",
+				result.baud, result.actualBaud, i2cSpeeds[ss], result.bytes, result.bytesVerified, result.errors, result.lineErrors,
+				result.elapsedMs, result.bytesPerSec, result.minRoundTripMicros, result.avgRoundTripMicros, result.maxRoundTripMicros);
+		}
+	}
+
+	Wire.end();
+	Wire.setSpeed(CLOCK_SPEED_100KHZ);
+	extSerial.begin(9600);
+	Log.info("runLoopbackTests completed failures=%u", failures);
+}
@@ -10,6 +10,7 @@ static Logger _log("app.ser");
 static const uint8_t subAddrs[4] = { 0x4d, 0x4c, 0x49, 0x48};
 
 SC16IS740Base::SC16IS740Base() {
+	rxBuffer.setBuffer(readAheadBuf, sizeof(readAheadBuf));
 }
 
 SC16IS740Base::~SC16IS740Base() {
@@ -17,161 +18,1035 @@ SC16IS740Base::~SC16IS740Base() {
 }
 
 bool SC16IS740Base::begin(int baudRate, uint8_t options) {
+	std::lock_guard<SC16IS740Base> guard(*this);
+
+	if (baudRate <= 0 || !isBaudValid(oscillatorHz, baudRate, baudTolerancePermille)) {
+		_log.error("baud rate %d cannot be generated from oscillator %d", baudRate, oscillatorHz);
+		return false;
+	}
 
 	preBegin();
 
+	// The transport limits are constant, so they're cached here instead of calling the virtual
+	// functions in every transfer. Never more than the 64 byte hardware FIFO.
+	readMax = readInternalMax();
+	if (readMax > 64) {
+		readMax = 64;
+	}
+	writeMax = writeInternalMax();
+	if (writeMax > 64) {
+		writeMax = 64;
+	}
+
 	// My test board uses this oscillator
 	// KC3225K1.84320C1GE00
 	// OSC XO 1.8432MHz CMOS SMD $1.36
 	// https://www.digikey.com/product-detail/en/avx-corp-kyocera-corp/KC3225K1.84320C1GE00/1253-1488-1-ND/5322590
 	// Another suggested frequency from the data sheet is 3.072 MHz
 
-	// The divider devices the clock frequency to 16x the baud rate
-	int div = oscillatorHz / (baudRate * 16);
+	// The state of the chip is unknown, so every register is written here and the shadow
+	// copies are initialized. After this, setBaud() and setFormat() only write what changed.
+	uint32_t prescaler = prescalerForBaud(oscillatorHz, baudRate);
+	if (prescaler == 4) {
+		// MCR[7] can only be set with the enhanced functions enabled
+		efrValue |= EFR_ENHANCED;
+		mcrValue |= MCR_CLOCK_DIV4;
+	}
+	else {
+		mcrValue &= ~MCR_CLOCK_DIV4;
+	}
+	this->baudRate = baudRate;
+	actualBaud = actualBaudFor(oscillatorHz, baudRate);
+	divisor = divisorForBaud(oscillatorHz, baudRate, prescaler);
+	lcrValue = options & 0x3f;
 
 	writeRegister(LCR_REG, LCR_SPECIAL_START); // 0x80
-	writeRegister(DLL_REG, div & 0xff);
-	writeRegister(DLH_REG, div >> 8);
+	writeRegister(DLL_REG, divisor & 0xff);
+	writeRegister(DLH_REG, divisor >> 8);
 	writeRegister(LCR_REG, LCR_SPECIAL_END); // 0xbf
+	writeRegister(EFR_REG, efrValue);
+	if (efrValue & SW_FLOW_MASK) {
+		writeRegister(XON1_REG, xon1Char);
+		writeRegister(XON2_REG, xon2Char);
+		writeRegister(XOFF1_REG, xoff1Char);
+		writeRegister(XOFF2_REG, xoff2Char);
+	}
 
-	writeRegister(LCR_REG, options & 0x3f);
+	writeRegister(LCR_REG, lcrValue);
+
+	if (tcrValue != 0 || tlrValue != 0) {
+		// TCR and TLR replace MSR and SPR while MCR[2] is set
+		writeRegister(MCR_REG, mcrValue | MCR_TCR_TLR_ENABLE);
+		writeRegister(TCR_REG, tcrValue);
+		writeRegister(TLR_REG, tlrValue);
+	}
+	writeRegister(MCR_REG, mcrValue);
+	writeRegister(EFCR_REG, efcrValue);
 
 	// Enable FIFOs
-	writeRegister(FCR_IIR_REG, 0x07); // Enable FIFO, Clear RX and TX FIFOs
+	fcrValue = FCR_FIFO_ENABLE | FCR_RX_TRIGGER_16;
+	resetFifos();
+
+	ierValue = 0;
+	if (intPin >= 0) {
+		// IRQ is open-drain, active low. It stays asserted while the RX FIFO is at or above the
+		// trigger level, or there is data in the FIFO that has been idle for 4 character times.
+		// The THR interrupt is enabled only while there is data in txBuffer.
+		pinMode(intPin, INPUT_PULLUP);
+		attachInterrupt(intPin, &SC16IS740Base::interruptHandler, this, FALLING);
+	}
+	if (usesInterrupts()) {
+		// When managed by SC16IS740Scheduler without an interrupt pin, IIR is polled instead
+		ierValue |= IER_RHR;
+	}
+	writeRegister(IEF_REG, ierValue);
 
-	// Also MCR?
 	return true;
 }
 
+bool SC16IS740Base::setBaud(int baudRate) {
+	std::lock_guard<SC16IS740Base> guard(*this);
+
+	if (baudRate <= 0 || !isBaudValid(oscillatorHz, baudRate, baudTolerancePermille)) {
+		return false;
+	}
+
+	uint32_t prescaler = prescalerForBaud(oscillatorHz, baudRate);
+	uint16_t div = divisorForBaud(oscillatorHz, baudRate, prescaler);
+	this->baudRate = baudRate;
+	actualBaud = actualBaudFor(oscillatorHz, baudRate);
+
+	bool result = true;
+
+	uint8_t mcr = (prescaler == 4) ? (mcrValue | MCR_CLOCK_DIV4) : (mcrValue & ~MCR_CLOCK_DIV4);
+	if (mcr != mcrValue && (efrValue & EFR_ENHANCED) == 0) {
+		efrValue |= EFR_ENHANCED;
+		result = writeEnhancedRegister(EFR_REG, efrValue);
+	}
+	result = writeShadowed(MCR_REG, mcrValue, mcr) && result;
+
+	if (div == divisor) {
+		return result;
+	}
+
+	// Setting LCR[7] selects DLL and DLH in place of RHR/THR and IER without changing the data format
+	result = writeRegister(LCR_REG, lcrValue | LCR_SPECIAL_START) && result;
+	if ((div & 0xff) != (divisor & 0xff)) {
+		result = writeRegister(DLL_REG, div & 0xff) && result;
+	}
+	if ((div >> 8) != (divisor >> 8)) {
+		result = writeRegister(DLH_REG, div >> 8) && result;
+	}
+	result = writeRegister(LCR_REG, lcrValue) && result;
+
+	divisor = div;
+	return result;
+}
+
+bool SC16IS740Base::setFormat(uint8_t options) {
+	std::lock_guard<SC16IS740Base> guard(*this);
+
+	return writeShadowed(LCR_REG, lcrValue, options & 0x3f);
+}
+
+void SC16IS740Base::resetFifos() {
+	// The reset bits are self-clearing so they're not kept in fcrValue
+	writeRegister(FCR_IIR_REG, fcrValue | FCR_RX_FIFO_RESET | FCR_TX_FIFO_RESET);
+
+	rxBuffer.clear();
+	txBuffer.clear();
+	txCredit = 64; // TX FIFO was just reset
+}
+
+bool SC16IS740Base::writeEnhancedRegister(uint8_t reg, uint8_t value) {
+	bool result = writeRegister(LCR_REG, LCR_SPECIAL_END);
+	result = writeRegister(reg, value) && result;
+	result = writeRegister(LCR_REG, lcrValue) && result;
+	return result;
+}
+
+bool SC16IS740Base::writeShadowed(uint8_t reg, uint8_t &shadow, uint8_t value) {
+	if (value == shadow) {
+		return true;
+	}
+	shadow = value;
+	return writeRegister(reg, value);
+}
+
+void SC16IS740Base::loop() {
+	serviceRx();
+	serviceTx();
+}
+
 int SC16IS740Base::available() {
-	return readRegister(RXLVL_REG);
+	// Only go to the bus when the read-ahead data has been consumed
+	if (rxBuffer.available() == 0 && !managed) {
+		serviceRx();
+	}
+	return (int) rxBuffer.available();
 }
 
 int SC16IS740Base::availableForWrite() {
-	return readRegister(TXLVL_REG);
+	if (txBuffer.isValid()) {
+		return (int) txBuffer.availableForWrite();
+	}
+	txCredit = readRegister(TXLVL_REG);
+	return (int) txCredit;
 }
 
 
 int SC16IS740Base::read() {
-	if (hasPeek) {
-		hasPeek = false;
-		return peekByte;
+	if (rxBuffer.available() == 0 && !managed) {
+		serviceRx();
 	}
-	else {
-		if (available()) {
-			return readRegister(RHR_THR_REG);
+	return rxBuffer.read();
+}
+
+int SC16IS740Base::peek() {
+	if (rxBuffer.available() == 0 && !managed) {
+		serviceRx();
+	}
+	return rxBuffer.peek();
+}
+
+void SC16IS740Base::flush() {
+	flush(0);
+}
+
+bool SC16IS740Base::flush(unsigned long timeoutMs) {
+	unsigned long start = millis();
+
+	while(txBuffer.available() > 0) {
+		if (!workerRunning()) {
+			std::lock_guard<SC16IS740Base> guard(*this);
+			serviceTx();
+		}
+		if (timeoutMs != 0 && millis() - start >= timeoutMs) {
+			return false;
+		}
+		if (txBuffer.available() > 0) {
+			// The queue can't move until the TX FIFO drains. With a worker thread, the worker moves it.
+			waitForTxDrain(64 - txCredit);
+		}
+	}
+
+	while(true) {
+		uint8_t lsr = readRegister(LSR_REG);
+		if (lsr & LSR_TEMT) {
+			// Both the TX FIFO and the transmit shift register are empty; the line is idle
+			txCredit = 64;
+			return true;
+		}
+		if (timeoutMs != 0 && millis() - start >= timeoutMs) {
+			return false;
+		}
+
+		if (lsr & LSR_THRE) {
+			// Only the character in the shift register is left. Poll a few times per character
+			// so the turnaround isn't delayed by up to a full character time.
+			waitMicros(charTimeMicros() / 4 + 1);
+		}
+		else {
+			txCredit = readRegister(TXLVL_REG);
+			// Remaining FIFO bytes plus the one in the shift register
+			waitForTxDrain(64 - txCredit + 1);
+		}
+	}
+}
+
+size_t SC16IS740Base::write(uint8_t c) {
+	if (txBuffer.isValid()) {
+		return write(&c, 1);
+	}
+
+	if (writeBlocksWhenFull) {
+		// Block until there is room in the buffer
+		while(txFifoSpace(1) == 0) {
+			blockForTxDrain(1);
+		}
+	}
+
+	writeRegister(RHR_THR_REG, c);
+	stats.bytesOut++;
+	if (txCredit > 0) {
+		txCredit--;
+	}
+
+	return 1;
+}
+
+size_t SC16IS740Base::write(const uint8_t *buffer, size_t size) {
+	return writeImpl<SC16IS740Base>(buffer, size);
+}
+
+size_t SC16IS740Base::writev(const WriteVec *vec, size_t count) {
+	size_t written = 0;
+
+	if (txBuffer.isValid()) {
+		// Queue everything first so serviceTx() can pack it into as few transactions as possible
+		size_t ii;
+		for(ii = 0; ii < count; ii++) {
+			size_t n = txBuffer.write(vec[ii].buffer, vec[ii].size);
+			updateHighWater(stats.txBufferHighWater, txBuffer.available());
+			written += n;
+			if (n < vec[ii].size) {
+				// Queue is full; write() services it and blocks if configured to
+				size_t rest = write(vec[ii].buffer + n, vec[ii].size - n);
+				written += rest;
+				if (rest < vec[ii].size - n) {
+					// Stop at the first short write so the data sent is a prefix of the vectors
+					return written;
+				}
+				break;
+			}
+		}
+		if (ii == count) {
+			if (!managed) {
+				serviceTx();
+			}
+		}
+		else {
+			for(ii++; ii < count; ii++) {
+				size_t n = write(vec[ii].buffer, vec[ii].size);
+				written += n;
+				if (n < vec[ii].size) {
+					break;
+				}
+			}
+		}
+		return written;
+	}
+
+	size_t seg = 0;
+	size_t offset = 0;
+
+	while(seg < count) {
+		// Find how much the next transaction can hold, limited by writeMax and WRITEV_MAX_PIECES
+		size_t wanted = 0;
+		size_t numPieces = 0;
+		for(size_t ii = seg, off = offset; ii < count && wanted < writeMax && numPieces < WRITEV_MAX_PIECES; ii++, off = 0) {
+			size_t n = vec[ii].size - off;
+			if (n == 0) {
+				continue;
+			}
+			if (n > writeMax - wanted) {
+				n = writeMax - wanted;
+			}
+			wanted += n;
+			numPieces++;
+		}
+		if (wanted == 0) {
+			break;
+		}
+
+		bool done = false;
+		if (writeBlocksWhenFull) {
+			size_t avail;
+			while((avail = txFifoSpace(wanted)) < wanted) {
+				blockForTxDrain(wanted - avail);
+			}
+		}
+		else {
+			size_t avail = txFifoSpace(wanted);
+			if (wanted > avail) {
+				wanted = avail;
+				done = true;
+			}
+			if (wanted == 0) {
+				break;
+			}
+		}
+
+		WriteVec pieces[WRITEV_MAX_PIECES];
+		size_t chunk = 0;
+		numPieces = 0;
+		while(chunk < wanted && seg < count) {
+			size_t n = vec[seg].size - offset;
+			if (n > wanted - chunk) {
+				n = wanted - chunk;
+			}
+			if (n > 0) {
+				pieces[numPieces].buffer = vec[seg].buffer + offset;
+				pieces[numPieces].size = n;
+				numPieces++;
+				chunk += n;
+				offset += n;
+			}
+			if (offset >= vec[seg].size) {
+				seg++;
+				offset = 0;
+			}
+		}
+
+		if (!writeInternalVec(pieces, numPieces)) {
+			// Failed to write
+			break;
+		}
+		txCredit -= chunk;
+		written += chunk;
+
+		if (done) {
+			break;
+		}
+	}
+
+	return written;
+}
+
+bool SC16IS740Base::writeInternalVec(const WriteVec *vec, size_t count) {
+	uint8_t buf[64];
+	size_t size = 0;
+
+	for(size_t ii = 0; ii < count; ii++) {
+		if (size + vec[ii].size > sizeof(buf)) {
+			return false;
+		}
+		memcpy(&buf[size], vec[ii].buffer, vec[ii].size);
+		size += vec[ii].size;
+	}
+	return writeInternal(buf, size);
+}
+
+/**
+ * @brief Read a multiple bytes to the serial port.
+ *
+ * @param buffer The buffer to read data into. It will not be null terminated.
+ *
+ * @param size The maximum number of bytes to read (buffer size)
+ *
+ * @return The number of bytes actually read or -1 if there are no bytes available to read.
+ *
+ * This is faster than reading a single byte at time because up to 32 bytes of data can
+ * be sent or received in an I2C transaction, greatly reducing overhead.
+ */
+int SC16IS740Base::read(uint8_t *buffer, size_t size) {
+	if (rxBuffer.available() == 0 && !managed) {
+		serviceRx();
+	}
+	size_t count = rxBuffer.read(buffer, size);
+	return (count > 0) ? (int) count : -1;
+}
+
+size_t SC16IS740Base::readBytes(char *buffer, size_t length) {
+	size_t count = 0;
+	unsigned long start = millis();
+
+	while(count < length) {
+		unsigned long pollStart = micros();
+		if (rxBuffer.available() == 0 && (!managed || onWorkerThread())) {
+			serviceRx();
+		}
+		size_t n = rxBuffer.read((uint8_t *)&buffer[count], length - count);
+		if (n > 0) {
+			count += n;
+			start = millis();
+			if (count >= length) {
+				break;
+			}
+		}
+		unsigned long elapsed = millis() - start;
+		if (elapsed >= _timeout) {
+			break;
+		}
+		// Everything available was taken, so wait for more rather than polling the bus again right away
+		waitForRx(length - count, (_timeout - elapsed) * 1000, micros() - pollStart);
+	}
+	return count;
+}
+
+size_t SC16IS740Base::readBytesUntil(char terminator, char *buffer, size_t length) {
+	size_t count = 0;
+
+	while(count < length) {
+		int c = timedReadBuffered();
+		if (c < 0 || c == terminator) {
+			break;
+		}
+		buffer[count++] = (char) c;
+	}
+	return count;
+}
+
+bool SC16IS740Base::find(char *target) {
+	return findUntil(target, strlen(target), NULL, 0);
+}
+
+bool SC16IS740Base::find(char *target, size_t length) {
+	return findUntil(target, length, NULL, 0);
+}
+
+bool SC16IS740Base::findUntil(char *target, char *terminator) {
+	return findUntil(target, strlen(target), terminator, strlen(terminator));
+}
+
+bool SC16IS740Base::findUntil(char *target, size_t targetLen, char *terminate, size_t termLen) {
+	size_t index = 0;
+	size_t termIndex = 0;
+	int c;
+
+	if (targetLen == 0) {
+		return true;
+	}
+
+	while((c = timedReadBuffered()) >= 0) {
+		if (c != target[index]) {
+			index = 0;
+		}
+		if (c == target[index]) {
+			if (++index >= targetLen) {
+				return true;
+			}
+		}
+
+		if (termLen > 0 && c == terminate[termIndex]) {
+			if (++termIndex >= termLen) {
+				return false;
+			}
 		}
 		else {
+			termIndex = 0;
+		}
+	}
+	return false;
+}
+
+long SC16IS740Base::parseInt() {
+	bool isNegative = false;
+	long value = 0;
+
+	int c = peekNextDigitBuffered();
+	if (c < 0) {
+		return 0;
+	}
+
+	do {
+		if (c == '-') {
+			isNegative = true;
+		}
+		else {
+			value = value * 10 + c - '0';
+		}
+		rxBuffer.read();
+		c = timedReadBuffered(true);
+	} while(c >= '0' && c <= '9');
+
+	return isNegative ? -value : value;
+}
+
+float SC16IS740Base::parseFloat() {
+	bool isNegative = false;
+	bool isFraction = false;
+	long value = 0;
+	float fraction = 1.0;
+
+	int c = peekNextDigitBuffered();
+	if (c < 0) {
+		return 0;
+	}
+
+	do {
+		if (c == '-') {
+			isNegative = true;
+		}
+		else if (c == '.') {
+			isFraction = true;
+		}
+		else {
+			value = value * 10 + c - '0';
+			if (isFraction) {
+				fraction *= 0.1;
+			}
+		}
+		rxBuffer.read();
+		c = timedReadBuffered(true);
+	} while((c >= '0' && c <= '9') || c == '.');
+
+	if (isNegative) {
+		value = -value;
+	}
+	return isFraction ? value * fraction : value;
+}
+
+int SC16IS740Base::timedReadBuffered(bool peekOnly) {
+	unsigned long start = millis();
+
+	while(true) {
+		if (rxBuffer.available() == 0 && (!managed || onWorkerThread())) {
+			serviceRx();
+		}
+		int c = peekOnly ? rxBuffer.peek() : rxBuffer.read();
+		if (c >= 0) {
+			return c;
+		}
+		unsigned long elapsed = millis() - start;
+		if (elapsed >= _timeout) {
 			return -1;
 		}
+		waitForRx(1, (_timeout - elapsed) * 1000);
 	}
 }
 
-int SC16IS740Base::peek() {
-	if (!hasPeek) {
-		peekByte = read();
-		hasPeek = true;
+void SC16IS740Base::waitForRx(size_t chars, unsigned long maxMicros, unsigned long pollMicros) {
+	if (intPin >= 0 || chars == 0) {
+		chars = 1;
+	}
+	else if (chars > readMax) {
+		chars = readMax;
+	}
+	if (chars > RX_POLL_MAX_CHARS) {
+		chars = RX_POLL_MAX_CHARS;
+	}
+	unsigned long us = chars * charTimeMicros();
+	if (us <= pollMicros) {
+		// Draining the FIFO took the whole interval; poll again right away
+		return;
 	}
-	return peekByte;
+	us -= pollMicros;
+	if (us > maxMicros) {
+		us = maxMicros;
+	}
+	waitMicros(us);
 }
 
-void SC16IS740Base::flush() {
-	while(availableForWrite() < 64) {
-		delay(1);
+int SC16IS740Base::peekNextDigitBuffered() {
+	while(true) {
+		int c = timedReadBuffered(true);
+		if (c < 0 || c == '-' || (c >= '0' && c <= '9')) {
+			return c;
+		}
+		rxBuffer.read();
+	}
+}
+
+void SC16IS740Base::serviceRx() {
+	serviceRxImpl<SC16IS740Base>();
+}
+
+void SC16IS740Base::serviceFrame() {
+	if (frameReady.load(std::memory_order_acquire)) {
+		// Leave new data in the hardware FIFO until the previous frame has been read
+		return;
+	}
+
+	bool edgeSeen = false;
+	unsigned long edgeMicros = 0;
+	if (intPin >= 0) {
+		if (!interruptPending && pinReadFast(intPin) != LOW) {
+			return;
+		}
+		if (interruptPending) {
+			edgeSeen = true;
+			edgeMicros = interruptMicros;
+		}
+		interruptPending = false;
+	}
+
+	uint8_t iir = readRegister(FCR_IIR_REG);
+	if (iir & IIR_NO_INTERRUPT) {
+		return;
+	}
+	uint8_t source = iir & IIR_SOURCE_MASK;
+	if (source != IIR_RHR && source != IIR_RX_TIMEOUT) {
+		return;
+	}
+	bool endOfFrame = (source == IIR_RX_TIMEOUT);
+
+	size_t avail = readRegister(RXLVL_REG);
+	unsigned long levelMicros = micros();
+	size_t level = avail;
+	updateHighWater(stats.rxFifoHighWater, avail);
+
+	if (level > frameLeftInFifo) {
+		// Bytes arrived since the last drain, so estimate when the last one did. It can't be later
+		// than now, or 4 character times ago if the time-out has occurred.
+		unsigned long charUs = charTimeMicros();
+		unsigned long lastByte = levelMicros - (endOfFrame ? 4 * charUs : 0);
+		if (edgeSeen) {
+			unsigned long fromEdge = lastByte;
+			if (level >= rxTriggerLevel()) {
+				// The edge was the FIFO reaching the trigger level. Bytes within a frame are sent
+				// back-to-back, one character time apart.
+				fromEdge = edgeMicros + (level - rxTriggerLevel()) * charUs;
+			}
+			else if (endOfFrame) {
+				// The FIFO stayed below the trigger level, so the edge was the time-out itself. It
+				// occurs 4 character times after the later of the last byte arriving and the last
+				// RHR read, and new bytes arrived after that read.
+				fromEdge = edgeMicros - 4 * charUs;
+			}
+			if ((long) (fromEdge - lastByte) < 0) {
+				lastByte = fromEdge;
+			}
+		}
+		frameLastByteMicros = lastByte;
+	}
+	// Otherwise nothing arrived since the last drain, which restarted the chip's time-out, and the
+	// estimate made then still holds.
+
+	if (!endOfFrame && avail > 0) {
+		// The RX time-out interrupt only occurs if there is data in the FIFO, so always leave
+		// one byte behind until the end of the frame.
+		avail--;
+	}
+	frameLeftInFifo = level - avail;
+
+	uint8_t buf[64];
+
+	while(avail > 0) {
+		size_t count = avail;
+		if (count > readMax) {
+			count = readMax;
+		}
+		if (count > sizeof(buf)) {
+			count = sizeof(buf);
+		}
+		if (!readInternal(buf, count)) {
+			return;
+		}
+		avail -= count;
+
+		// Bytes beyond the end of frameBuf are discarded
+		size_t copy = count;
+		if (copy > frameBufSize - frameLen) {
+			copy = frameBufSize - frameLen;
+		}
+		memcpy(&frameBuf[frameLen], buf, copy);
+		frameLen += copy;
 	}
+
+	if (endOfFrame) {
+		frameTimestamp = millis() - (micros() - frameLastByteMicros) / 1000;
+		lineIdleMicros = frameLastByteMicros;
+
+		// Publishes frameBuf and frameLen to the thread that calls readFrame()
+		frameReady.store(true, std::memory_order_release);
+	}
+}
+
+bool SC16IS740Base::frameAvailable() {
+	if (!frameReady.load(std::memory_order_acquire) && !managed) {
+		serviceFrame();
+	}
+	return frameReady.load(std::memory_order_acquire);
+}
+
+size_t SC16IS740Base::readFrame(uint8_t *buffer, size_t size, unsigned long *timestamp) {
+	if (!frameAvailable()) {
+		return 0;
+	}
+
+	if (size > frameLen) {
+		size = frameLen;
+	}
+	memcpy(buffer, frameBuf, size);
+	if (timestamp) {
+		*timestamp = frameTimestamp;
+	}
+
+	frameLen = 0;
+	// Hands frameBuf back to serviceFrame()
+	frameReady.store(false, std::memory_order_release);
+
+	return size;
+}
+
+size_t SC16IS740Base::writeFrame(const uint8_t *buffer, size_t size) {
+	// Wait for the line to have been idle for the inter-frame gap
+	long remaining = (long) interFrameMicros() - (long) (micros() - lineIdleMicros);
+	if (remaining > 0) {
+		waitMicros((unsigned long) remaining);
+	}
+
+	// The FIFO is empty when the line is idle, so the frame ends size character times from now
+	// (plus any time spent blocking in write()).
+	size_t written = write(buffer, size);
+	lineIdleMicros = micros() + written * charTimeMicros();
+
+	return written;
+}
+
+unsigned long SC16IS740Base::interFrameMicros() const {
+	// Modbus RTU uses a fixed 1750 us above 19200 baud, otherwise 3.5 character times
+	if (actualBaud > 19200) {
+		return 1750;
+	}
+	return (charTimeMicros() * 7) / 2;
+}
+
+void SC16IS740Base::serviceTx() {
+	serviceTxImpl<SC16IS740Base>();
+}
+
+unsigned long SC16IS740Base::charTimeMicros() const {
+	if (actualBaud <= 0) {
+		return 1000;
+	}
+
+	// Start bit + 5 to 8 data bits + optional parity + 1 or 2 stop bits
+	unsigned long bits = 1 + 5 + (lcrValue & 0x03);
+	if (lcrValue & 0x08) {
+		bits++;
+	}
+	bits += (lcrValue & 0x04) ? 2 : 1;
+
+	return (bits * 1000000UL + actualBaud - 1) / actualBaud;
+}
+
+void SC16IS740Base::waitForTxDrain(size_t chars) {
+	if (chars == 0) {
+		chars = 1;
+	}
+	waitMicros(chars * charTimeMicros());
+}
+
+void SC16IS740Base::blockForTxDrain(size_t chars) {
+	// Measured rather than requested, since delay() rounds up and other threads may run
+	unsigned long start = micros();
+	waitForTxDrain(chars);
+	stats.writeBlockedMicros += micros() - start;
+}
+
+void SC16IS740Base::waitMicros(unsigned long us) {
+	if (us < 1000) {
+		delayMicroseconds(us);
+	}
+	else {
+		// delay() allows other threads to run
+		delay((us + 999) / 1000);
+	}
+}
+
+size_t SC16IS740Base::txFifoSpace(size_t needed) {
+	return txFifoSpaceImpl<SC16IS740Base>(needed);
+}
+
+void SC16IS740Base::setTxInterrupt(bool enable) {
+	writeShadowed(IEF_REG, ierValue, enable ? (ierValue | IER_THR) : (ierValue & ~IER_THR));
+}
+
+uint8_t SC16IS740Base::pendingWork() {
+	uint8_t work = 0;
+
+	// Starting or stopping the TX queue doesn't depend on the chip state
+	bool txQueued = txBuffer.isValid() && txBuffer.available() > 0;
+	if (txQueued != ((ierValue & IER_THR) != 0)) {
+		work |= WORK_TX;
+	}
+
+	if (intPin >= 0 && !interruptPending && pinReadFast(intPin) != LOW) {
+		// IRQ not asserted, nothing to do on the chip
+		return work;
+	}
+
+	// Received data stays in the hardware FIFO until the application reads the receive buffer or frame
+	bool rxBlocked = (frameBuf != 0) ? frameReady.load(std::memory_order_acquire) : (rxBuffer.availableForWrite() == 0);
+	if (rxBlocked && (ierValue & IER_THR) == 0) {
+		// Only RX interrupts are enabled, so IIR can't report anything that can be done now
+		return work;
+	}
+
+	// One IIR read replaces separate RXLVL and TXLVL checks
+	uint8_t iir = readRegister(FCR_IIR_REG);
+	if ((iir & IIR_NO_INTERRUPT) == 0) {
+		switch(iir & IIR_SOURCE_MASK) {
+		case IIR_RHR:
+		case IIR_RX_TIMEOUT:
+			if (!rxBlocked) {
+				work |= WORK_RX;
+			}
+			else {
+				// RX interrupts hide a pending THR interrupt, so let serviceTx() check TXLVL
+				work |= WORK_TX;
+			}
+			break;
+
+		case IIR_THR:
+			work |= WORK_TX;
+			break;
+		}
+	}
+	return work;
+}
+
+bool SC16IS740Base::serviceScheduled() {
+	uint8_t work = pendingWork();
+	bool progress = false;
+
+	if (work & WORK_RX) {
+		uint32_t bytesIn = stats.bytesIn;
+		bool wasReady = frameReady.load(std::memory_order_acquire);
+		serviceRx();
+		bool received = (frameBuf != 0) ? (frameReady.load(std::memory_order_acquire) && !wasReady) : (stats.bytesIn != bytesIn);
+		if (received && receiveCallback) {
+			receiveCallback(*this);
+		}
+		progress = received || stats.bytesIn != bytesIn;
+	}
+	if (work & WORK_TX) {
+		uint32_t bytesOut = stats.bytesOut;
+		bool queued = txBuffer.isValid() && txBuffer.available() > 0;
+		serviceTx();
+		if (queued && txBuffer.available() == 0 && txEmptyCallback) {
+			txEmptyCallback(*this);
+		}
+		progress = progress || stats.bytesOut != bytesOut;
+	}
+
+	// Reporting work that couldn't be done (a full receive buffer, an unread frame) as progress
+	// would keep the scheduler from ever sleeping
+	return progress;
+}
+
+bool SC16IS740Base::workerRunning() const {
+	return scheduler != 0 && scheduler->isThreadRunning() && !scheduler->isWorkerThread();
+}
+
+bool SC16IS740Base::onWorkerThread() const {
+	return scheduler != 0 && scheduler->isWorkerThread();
+}
+
+void SC16IS740Base::lock() {
+	if (scheduler) {
+		scheduler->lock();
+	}
+}
+
+void SC16IS740Base::unlock() {
+	if (scheduler) {
+		scheduler->unlock();
+	}
+}
+
+SC16IS740Stats SC16IS740Base::getStats() const {
+	return stats;
+}
+
+void SC16IS740Base::resetStats() {
+	stats = SC16IS740Stats();
 }
 
-size_t SC16IS740Base::write(uint8_t c) {
+bool SC16IS740Base::runLoopbackTest(int baud, size_t size, SC16IS740LoopbackResult &result) {
+	result = SC16IS740LoopbackResult();
+	result.baud = baud;
 
-	if (writeBlocksWhenFull) {
-		// Block until there is room in the buffer
-		while(!availableForWrite()) {
-			delay(1);
-		}
+	if (managed || frameBuf != 0) {
+		// The test reads the port directly, which isn't possible in these modes
+		return false;
 	}
 
-	writeRegister(RHR_THR_REG, c);
-
-	return 1;
-}
+	int savedBaud = baudRate;
+	if (!setBaud(baud)) {
+		return false;
+	}
+	result.actualBaud = actualBaud;
+
+	writeShadowed(MCR_REG, mcrValue, mcrValue | MCR_LOOPBACK);
+	waitForTxDrain(1);
+	resetFifos();
+	readRegister(LSR_REG); // Clears any error bits from before the test
+
+	// Give up on a byte after the time to send the whole in-flight window plus a bus stall allowance
+	unsigned long timeoutMicros = LOOPBACK_MAX_IN_FLIGHT * charTimeMicros() + 100000;
+
+	// Round-trip time of single bytes on an idle line
+	uint32_t totalMicros = 0;
+	size_t samples = 0;
+	for(size_t ii = 0; ii < LOOPBACK_LATENCY_SAMPLES; ii++) {
+		uint8_t c = loopbackPattern(ii);
+		unsigned long start = micros();
+		write(c);
+		if (!managed) {
+			serviceTx();
+		}
 
-size_t SC16IS740Base::write(const uint8_t *buffer, size_t size) {
-	size_t written = 0;
-	bool done = false;
+		int r;
+		while((r = read()) < 0 && micros() - start < timeoutMicros) {
+		}
+		uint32_t elapsed = (uint32_t) (micros() - start);
 
-	while(size > 0 && !done) {
-		size_t count = size;
-		if (count > writeInternalMax()) {
-			count = writeInternalMax();
+		if (r != c) {
+			result.errors++;
+			continue;
 		}
+		if (samples == 0 || elapsed < result.minRoundTripMicros) {
+			result.minRoundTripMicros = elapsed;
+		}
+		if (elapsed > result.maxRoundTripMicros) {
+			result.maxRoundTripMicros = elapsed;
+		}
+		totalMicros += elapsed;
+		samples++;
+	}
+	if (samples > 0) {
+		result.avgRoundTripMicros = totalMicros / samples;
+	}
 
-		if (writeBlocksWhenFull) {
-			while(true) {
-				int avail = availableForWrite();
-				if (count <= (size_t) avail) {
-					break;
-				}
-				delay(1);
+	// Throughput, keeping few enough bytes in flight that the RX FIFO can't overrun
+	uint8_t buf[64];
+	size_t sent = 0;
+	size_t received = 0;
+	unsigned long start = millis();
+	unsigned long lastProgress = micros();
+
+	while(received < size) {
+		size_t inFlight = sent - received;
+		if (sent < size && inFlight < LOOPBACK_MAX_IN_FLIGHT) {
+			size_t count = size - sent;
+			if (count > LOOPBACK_MAX_IN_FLIGHT - inFlight) {
+				count = LOOPBACK_MAX_IN_FLIGHT - inFlight;
 			}
-		}
-		else {
-			int avail = availableForWrite();
-			if (count > (size_t) avail) {
-				count = (size_t) avail;
-				done = true;
+			if (count > sizeof(buf)) {
+				count = sizeof(buf);
 			}
+			for(size_t ii = 0; ii < count; ii++) {
+				buf[ii] = loopbackPattern(sent + ii);
+			}
+			sent += write(buf, count);
 		}
 
-		if (count == 0) {
-			break;
+		int count = read(buf, sizeof(buf));
+		if (count > 0) {
+			for(int ii = 0; ii < count; ii++) {
+				if (buf[ii] == loopbackPattern(received + ii)) {
+					result.bytesVerified++;
+				}
+				else {
+					result.errors++;
+				}
+			}
+			received += count;
+			lastProgress = micros();
 		}
-
-		if (!writeInternal(buffer, count)) {
-			// Failed to write
+		else if (micros() - lastProgress >= timeoutMicros) {
+			_log.info("runLoopbackTest timeout baud=%d sent=%u received=%u", baud, sent, received);
+			result.errors += size - received;
 			break;
 		}
-		buffer += count;
-		size -= count;
-		written += count;
 	}
 
-	return written;
-}
+	result.bytes = size;
+	result.elapsedMs = millis() - start;
+	result.bytesPerSec = (uint32_t) ((uint64_t) result.bytesVerified * 1000 / (result.elapsedMs ? result.elapsedMs : 1));
 
-/**
- * @brief Read a multiple bytes to the serial port.
- *
- * @param buffer The buffer to read data into. It will not be null terminated.
- *
- * @param size The maximum number of bytes to read (buffer size)
- *
- * @return The number of bytes actually read or -1 if there are no bytes available to read.
- *
- * This is faster than reading a single byte at time because up to 32 bytes of data can
- * be sent or received in an I2C transaction, greatly reducing overhead.
- */
-int SC16IS740Base::read(uint8_t *buffer, size_t size) {
-	int avail = available();
-	if (avail == 0) {
-		// No data to read
-		return -1;
-	}
-	if (size > (size_t) avail) {
-		size = (size_t) avail;
-	}
-	if (size > readInternalMax()) {
-		size = readInternalMax();
-	}
-	if (!readInternal(buffer, size)) {
-		return -1;
+	if (readRegister(LSR_REG) & (LSR_OVERRUN_ERROR | LSR_PARITY_ERROR | LSR_FRAMING_ERROR)) {
+		result.lineErrors++;
 	}
 
-	return (int) size;
+	writeShadowed(MCR_REG, mcrValue, mcrValue & ~MCR_LOOPBACK);
+	resetFifos();
+	setBaud(savedBaud);
+
+	return result.errors == 0 && result.lineErrors == 0;
+}
+
+void SC16IS740Base::interruptHandler() {
+	interruptMicros = micros();
+	interruptPending = true;
 }
 
 
 
-SC16IS740::SC16IS740(TwoWire &wire, int addr) : wire(wire) {
+SC16IS740I2CTransport::SC16IS740I2CTransport(TwoWire &wire, int addr) : wire(wire) {
 
 	if (addr < (int) sizeof(subAddrs)) {
 		// Use lookup table
@@ -183,23 +1058,31 @@ SC16IS740::SC16IS740(TwoWire &wire, int addr) : wire(wire) {
 	}
 }
 
-SC16IS740::~SC16IS740() {
+SC16IS740I2CTransport &SC16IS740I2CTransport::withBufferSize(size_t size) {
+	if (size < 2) {
+		size = 2;
+	}
 
+	bufferSize = size;
+	return *this;
 }
 
-bool SC16IS740::preBegin() {
+bool SC16IS740I2CTransport::begin() {
 	wire.begin();
 	return true;
 }
 
 // Note: reg is the register 0 - 15, not the shifted value with the channel select bits. Channel is always 0
 // on the SC16IS740.
-uint8_t SC16IS740::readRegister(uint8_t reg) {
+uint8_t SC16IS740I2CTransport::readRegister(uint8_t reg, SC16IS740Stats &stats) {
 	wire.beginTransmission(addr);
 	wire.write(reg << 3);
 	wire.endTransmission(false);
 
-	wire.requestFrom(addr, 1, true);
+	stats.registerReads++;
+	if (wire.requestFrom(addr, 1, true) < 1) {
+		stats.busErrors++;
+	}
 	uint8_t value = (uint8_t) wire.read();
 
 	_log.trace("readRegister reg=%d value=%d", reg, value);
@@ -208,7 +1091,7 @@ uint8_t SC16IS740::readRegister(uint8_t reg) {
 }
 
 // Note: reg is the register 0 - 15, not the shifted value with the channel select bits
-bool SC16IS740::writeRegister(uint8_t reg, uint8_t value) {
+bool SC16IS740I2CTransport::writeRegister(uint8_t reg, uint8_t value, SC16IS740Stats &stats) {
 	wire.beginTransmission(addr);
 	wire.write(reg << 3);
 	wire.write(value);
@@ -223,20 +1106,26 @@ bool SC16IS740::writeRegister(uint8_t reg, uint8_t value) {
 	// 4: data byte transfer timeout
 	// 5: data byte transfer succeeded, busy timeout immediately after
 
+	stats.registerWrites++;
+	if (stat != 0) {
+		stats.busErrors++;
+	}
+
 	_log.trace("writeRegister reg=%d value=%d stat=%d", reg, value, stat);
-	// _log.trace("read after write value=%d", readRegister(reg));
 
 	return (stat == 0);
 }
 
 
-bool SC16IS740::readInternal(uint8_t *buffer, size_t size) {
+bool SC16IS740I2CTransport::readInternal(uint8_t *buffer, size_t size, SC16IS740Stats &stats) {
 	wire.beginTransmission(addr);
-	wire.write(RHR_THR_REG << 3);
+	wire.write(SC16IS740Base::RHR_THR_REG << 3);
 	wire.endTransmission(false);
 
-	uint8_t numRcvd = wire.requestFrom(addr, size, (uint8_t)true);
+	stats.bulkReads++;
+	uint8_t numRcvd = wire.requestFrom(addr, (uint8_t)size, (uint8_t)true);
 	if (numRcvd < size) {
+		stats.busErrors++;
 		_log.info("readInternal failed numRcvd=%u size=%u", numRcvd, size);
 		return false;
 	}
@@ -244,6 +1133,7 @@ bool SC16IS740::readInternal(uint8_t *buffer, size_t size) {
 	for(size_t ii = 0; ii < size; ii++) {
 		buffer[ii] = (uint8_t) wire.read();
 	}
+	stats.bytesIn += size;
 
 	_log.trace("readInternal %d bytes", size);
 
@@ -251,34 +1141,132 @@ bool SC16IS740::readInternal(uint8_t *buffer, size_t size) {
 }
 
 
-bool SC16IS740::writeInternal(const uint8_t *buffer, size_t size) {
+bool SC16IS740I2CTransport::writeInternal(const uint8_t *buffer, size_t size, SC16IS740Stats &stats) {
 	wire.beginTransmission(addr);
-	wire.write(RHR_THR_REG << 3);
+	wire.write(SC16IS740Base::RHR_THR_REG << 3);
 	wire.write(buffer, size);
 
 	int stat = wire.endTransmission(true);
 
-	// stat:
-	// 0: success
-	// 1: busy timeout upon entering endTransmission()
-	// 2: START bit generation timeout
-	// 3: end of address transmission timeout
-	// 4: data byte transfer timeout
-	// 5: data byte transfer succeeded, busy timeout immediately after
+	// stat: see writeRegister()
+
+	stats.bulkWrites++;
+	if (stat == 0) {
+		stats.bytesOut += size;
+	}
+	else {
+		stats.busErrors++;
+	}
 
 	_log.trace("writeInternal size=%d stat=%d", size, stat);
 
 	return (stat == 0);
 }
 
-SC16IS740SPI::SC16IS740SPI(SPIClass &spi, int cs, int intPin) : spi(spi), cs(cs), intPin(intPin) {
+bool SC16IS740I2CTransport::writeInternalVec(const SC16IS740Base::WriteVec *vec, size_t count, SC16IS740Stats &stats) {
+	wire.beginTransmission(addr);
+	wire.write(SC16IS740Base::RHR_THR_REG << 3);
+
+	size_t size = 0;
+	for(size_t ii = 0; ii < count; ii++) {
+		wire.write(vec[ii].buffer, vec[ii].size);
+		size += vec[ii].size;
+	}
+
+	int stat = wire.endTransmission(true);
+
+	stats.bulkWrites++;
+	if (stat == 0) {
+		stats.bytesOut += size;
+	}
+	else {
+		stats.busErrors++;
+	}
+
+	_log.trace("writeInternalVec count=%u size=%u stat=%d", count, size, stat);
+
+	return (stat == 0);
+}
+
 
+SC16IS740::SC16IS740(TwoWire &wire, int addr) : transport(wire, addr) {
 }
-SC16IS740SPI::~SC16IS740SPI() {
 
+SC16IS740 &SC16IS740::withI2CBufferSize(size_t size) {
+	transport.withBufferSize(size);
+	return *this;
 }
 
-bool SC16IS740SPI::preBegin() {
+SC16IS740::~SC16IS740() {
+
+}
+
+bool SC16IS740::preBegin() {
+	return transport.begin();
+}
+
+size_t SC16IS740::readInternalMax() const {
+	return transport.readInternalMax();
+}
+
+size_t SC16IS740::writeInternalMax() const {
+	return transport.writeInternalMax();
+}
+
+uint8_t SC16IS740::readRegister(uint8_t reg) {
+	std::lock_guard<SC16IS740Base> guard(*this);
+	return transport.readRegister(reg, stats);
+}
+
+bool SC16IS740::writeRegister(uint8_t reg, uint8_t value) {
+	std::lock_guard<SC16IS740Base> guard(*this);
+	return transport.writeRegister(reg, value, stats);
+}
+
+bool SC16IS740::readInternal(uint8_t *buffer, size_t size) {
+	std::lock_guard<SC16IS740Base> guard(*this);
+	return transport.readInternal(buffer, size, stats);
+}
+
+bool SC16IS740::writeInternal(const uint8_t *buffer, size_t size) {
+	std::lock_guard<SC16IS740Base> guard(*this);
+	return transport.writeInternal(buffer, size, stats);
+}
+
+bool SC16IS740::writeInternalVec(const WriteVec *vec, size_t count) {
+	std::lock_guard<SC16IS740Base> guard(*this);
+	return transport.writeInternalVec(vec, count, stats);
+}
+
+SC16IS740SPITransport * volatile SC16IS740SPITransport::dmaAsyncInstance = 0;
+
+// Last settings applied to each SPI bus by an SC16IS740SPITransport object. Used with withSharedBusCache() to skip
+// reconfiguring the bus, and the settling delay, when the settings have not changed.
+typedef struct {
+	SPIClass *spi;
+	uint8_t clockSpeedMHz; // 0 = unknown
+} SharedBusSettings;
+
+static SharedBusSettings sharedBusSettings[4];
+
+static SharedBusSettings *findSharedBusSettings(SPIClass *spi) {
+	for(size_t ii = 0; ii < sizeof(sharedBusSettings) / sizeof(sharedBusSettings[0]); ii++) {
+		if (sharedBusSettings[ii].spi == spi) {
+			return &sharedBusSettings[ii];
+		}
+		if (sharedBusSettings[ii].spi == 0) {
+			sharedBusSettings[ii].spi = spi;
+			sharedBusSettings[ii].clockSpeedMHz = 0;
+			return &sharedBusSettings[ii];
+		}
+	}
+	return 0;
+}
+
+SC16IS740SPITransport::SC16IS740SPITransport(SPIClass &spi, int cs) : spi(spi), cs(cs) {
+}
+
+bool SC16IS740SPITransport::begin() {
 	spi.begin(cs);
 	digitalWrite(cs, HIGH);
 
@@ -290,8 +1278,7 @@ bool SC16IS740SPI::preBegin() {
 
 // Note: reg is the register 0 - 15, not the shifted value with the channel select bits. Channel is always 0
 // on the SC16IS740.
-uint8_t SC16IS740SPI::readRegister(uint8_t reg) {
-
+uint8_t SC16IS740SPITransport::readRegister(uint8_t reg, SC16IS740Stats &stats) {
 	beginTransaction();
 
 	spi.transfer(0x80 | reg << 3);
@@ -299,6 +1286,7 @@ uint8_t SC16IS740SPI::readRegister(uint8_t reg) {
 
 	endTransaction();
 
+	stats.registerReads++;
 
 	_log.trace("readRegister reg=%d value=%d", reg, value);
 
@@ -306,9 +1294,7 @@ uint8_t SC16IS740SPI::readRegister(uint8_t reg) {
 }
 
 // Note: reg is the register 0 - 15, not the shifted value with the channel select bits
-bool SC16IS740SPI::writeRegister(uint8_t reg, uint8_t value) {
-
-
+bool SC16IS740SPITransport::writeRegister(uint8_t reg, uint8_t value, SC16IS740Stats &stats) {
 	beginTransaction();
 
 	spi.transfer(reg << 3);
@@ -316,61 +1302,344 @@ bool SC16IS740SPI::writeRegister(uint8_t reg, uint8_t value) {
 
 	endTransaction();
 
+	stats.registerWrites++;
+
 	_log.trace("writeRegister reg=%d value=%d", reg, value);
-	// _log.trace("read after write value=%d", readRegister(reg));
 
 	return true;
 }
 
 
-bool SC16IS740SPI::readInternal(uint8_t *buffer, size_t size) {
+bool SC16IS740SPITransport::readInternal(uint8_t *buffer, size_t size, SC16IS740Stats &stats) {
+	if (useDma && size <= readInternalMax()) {
+		// beginTransaction() waits for any asynchronous transfer still using the DMA buffers
+		beginTransaction();
+		dmaTxBuf[0] = 0x80 | SC16IS740Base::RHR_THR_REG << 3;
+		memset(&dmaTxBuf[1], 0, size);
+		spi.transfer(dmaTxBuf, dmaRxBuf, size + 1, NULL);
+		endTransaction();
+
+		memcpy(buffer, &dmaRxBuf[1], size);
+
+		stats.bulkReads++;
+		stats.bytesIn += size;
+
+		_log.trace("readInternal %d bytes (DMA)", size);
+		return true;
+	}
+
 	beginTransaction();
 
-	spi.transfer(0x80 | RHR_THR_REG << 3);
+	spi.transfer(0x80 | SC16IS740Base::RHR_THR_REG << 3);
 	for(size_t ii = 0; ii < size; ii++) {
 		buffer[ii] = spi.transfer(0);
 	}
-	// spi.transfer(NULL, buffer, size, NULL);
 	endTransaction();
 
+	stats.bulkReads++;
+	stats.bytesIn += size;
+
 	_log.trace("readInternal %d bytes", size);
 
 	return true;
 }
 
-bool SC16IS740SPI::writeInternal(const uint8_t *buffer, size_t size) {
+bool SC16IS740SPITransport::writeInternal(const uint8_t *buffer, size_t size, SC16IS740Stats &stats) {
+	if (useDma && size <= writeInternalMax()) {
+		// Always copy into dmaTxBuf, as buffer may be in flash which is not accessible by DMA
+		// on some platforms. This also allows the register address to go out in the same transaction.
+		beginTransaction();
+		dmaTxBuf[0] = SC16IS740Base::RHR_THR_REG << 3;
+		memcpy(&dmaTxBuf[1], buffer, size);
+		spi.transfer(dmaTxBuf, NULL, size + 1, NULL);
+		endTransaction();
+
+		stats.bulkWrites++;
+		stats.bytesOut += size;
+		return true;
+	}
+
 	beginTransaction();
 
-	spi.transfer(RHR_THR_REG << 3);
+	spi.transfer(SC16IS740Base::RHR_THR_REG << 3);
 	for(size_t ii = 0; ii < size; ii++) {
 		spi.transfer(buffer[ii]);
 	}
-	// spi.transfer(const_cast<uint8_t *>(buffer), NULL, size, NULL);
 
 	endTransaction();
 
+	stats.bulkWrites++;
+	stats.bytesOut += size;
+
+	return true;
+}
+
+bool SC16IS740SPITransport::writeInternalVec(const SC16IS740Base::WriteVec *vec, size_t count, SC16IS740Stats &stats) {
+	if (useDma) {
+		// DMA needs a single buffer, so gather the pieces into dmaTxBuf after the register address
+		beginTransaction();
+		dmaTxBuf[0] = SC16IS740Base::RHR_THR_REG << 3;
+		size_t size = 0;
+		for(size_t ii = 0; ii < count; ii++) {
+			if (size + vec[ii].size > writeInternalMax()) {
+				endTransaction();
+				return false;
+			}
+			memcpy(&dmaTxBuf[1 + size], vec[ii].buffer, vec[ii].size);
+			size += vec[ii].size;
+		}
+		spi.transfer(dmaTxBuf, NULL, size + 1, NULL);
+		endTransaction();
+
+		stats.bulkWrites++;
+		stats.bytesOut += size;
+		return true;
+	}
+
+	beginTransaction();
+
+	spi.transfer(SC16IS740Base::RHR_THR_REG << 3);
+	for(size_t ii = 0; ii < count; ii++) {
+		for(size_t jj = 0; jj < vec[ii].size; jj++) {
+			spi.transfer(vec[ii].buffer[jj]);
+		}
+		stats.bytesOut += vec[ii].size;
+	}
+
+	endTransaction();
+
+	stats.bulkWrites++;
+
+	return true;
+}
+
+bool SC16IS740SPITransport::writeAsync(const uint8_t *buffer, size_t size, std::function<void()> completion, SC16IS740Stats &stats) {
+	if (size > writeInternalMax() || dmaAsyncInstance != 0) {
+		return false;
+	}
+
+	beginTransaction();
+
+	dmaAsyncInstance = this;
+	dmaBusy = true;
+	dmaCompletionCallback = completion;
+
+	dmaTxBuf[0] = SC16IS740Base::RHR_THR_REG << 3;
+	memcpy(&dmaTxBuf[1], buffer, size);
+	stats.bulkWrites++;
+	stats.bytesOut += size;
+
+	spi.transfer(dmaTxBuf, NULL, size + 1, dmaCompletion);
+
+	// endTransaction() is called from dmaCompletion
 	return true;
 }
 
+// static
+void SC16IS740SPITransport::dmaCompletion() {
+	SC16IS740SPITransport *instance = dmaAsyncInstance;
+	if (instance) {
+		instance->endTransaction();
+		dmaAsyncInstance = 0;
+		instance->dmaBusy = false;
+		if (instance->dmaCompletionCallback) {
+			instance->dmaCompletionCallback();
+		}
+	}
+}
+
+
+void SC16IS740SPITransport::beginTransaction() {
+	// Wait for an asynchronous DMA transfer from writeAsync() on this bus to complete, even if
+	// it was started by another object, as CS for that chip is still asserted
+	while(true) {
+		SC16IS740SPITransport *instance = dmaAsyncInstance;
+		if (instance == 0 || &instance->spi != &spi) {
+			break;
+		}
+	}
 
-void SC16IS740SPI::beginTransaction() {
 	if (sharedBus) {
-		setSpiSettings();
-		// Changing the SPI settings seems to leave the bus unstable for a period of time.
-		if (sharedBusDelay != 0) {
-			delayMicroseconds(sharedBusDelay);
+		SharedBusSettings *settings = sharedBusCache ? findSharedBusSettings(&spi) : 0;
+		if (settings == 0 || settings->clockSpeedMHz != spiClockSpeedMHz) {
+			setSpiSettings();
+			// Changing the SPI settings seems to leave the bus unstable for a period of time.
+			if (sharedBusDelay != 0) {
+				delayMicroseconds(sharedBusDelay);
+			}
 		}
 	}
 	pinResetFast(cs);
 }
 
-void SC16IS740SPI::endTransaction() {
+void SC16IS740SPITransport::endTransaction() {
 	pinSetFast(cs);
 }
 
-void SC16IS740SPI::setSpiSettings() {
+void SC16IS740SPITransport::setSpiSettings() {
 	// The SC16IS7xx can only do MSBFIRST, SPI_MODE0
 	spi.setBitOrder(MSBFIRST);
 	spi.setClockSpeed(spiClockSpeedMHz, MHZ); // Default: 4
 	spi.setDataMode(SPI_MODE0);
+
+	SharedBusSettings *settings = findSharedBusSettings(&spi);
+	if (settings) {
+		// Bit order and mode are the same for all SC16IS740SPITransport objects so only the speed is tracked
+		settings->clockSpeedMHz = spiClockSpeedMHz;
+	}
+}
+
+// static
+void SC16IS740SPITransport::sharedBusChanged(SPIClass &spi) {
+	SharedBusSettings *settings = findSharedBusSettings(&spi);
+	if (settings) {
+		settings->clockSpeedMHz = 0;
+	}
+}
+
+
+SC16IS740SPI::SC16IS740SPI(SPIClass &spi, int cs, int intPin) : transport(spi, cs) {
+	withInterruptPin(intPin);
+}
+SC16IS740SPI::~SC16IS740SPI() {
+
+}
+
+bool SC16IS740SPI::preBegin() {
+	return transport.begin();
+}
+
+uint8_t SC16IS740SPI::readRegister(uint8_t reg) {
+	std::lock_guard<SC16IS740Base> guard(*this);
+	return transport.readRegister(reg, stats);
+}
+
+bool SC16IS740SPI::writeRegister(uint8_t reg, uint8_t value) {
+	std::lock_guard<SC16IS740Base> guard(*this);
+	return transport.writeRegister(reg, value, stats);
+}
+
+bool SC16IS740SPI::readInternal(uint8_t *buffer, size_t size) {
+	std::lock_guard<SC16IS740Base> guard(*this);
+	return transport.readInternal(buffer, size, stats);
+}
+
+bool SC16IS740SPI::writeInternal(const uint8_t *buffer, size_t size) {
+	std::lock_guard<SC16IS740Base> guard(*this);
+	return transport.writeInternal(buffer, size, stats);
+}
+
+bool SC16IS740SPI::writeInternalVec(const WriteVec *vec, size_t count) {
+	std::lock_guard<SC16IS740Base> guard(*this);
+	return transport.writeInternalVec(vec, count, stats);
+}
+
+bool SC16IS740SPI::writeAsync(const uint8_t *buffer, size_t size, std::function<void()> completion) {
+	// The lock is only held while starting the transfer. Other objects on this bus wait for
+	// the transfer to complete in beginTransaction().
+	std::lock_guard<SC16IS740Base> guard(*this);
+
+	if (!transport.writeAsync(buffer, size, completion, stats)) {
+		return false;
+	}
+
+	// Keep the TX FIFO space estimate conservative so a following write() can't overrun the FIFO
+	txCredit = (txCredit > size) ? (txCredit - size) : 0;
+	return true;
+}
+
+// static
+void SC16IS740SPI::sharedBusChanged(SPIClass &spi) {
+	SC16IS740SPITransport::sharedBusChanged(spi);
+}
+
+
+SC16IS740Scheduler::SC16IS740Scheduler() {
+}
+
+SC16IS740Scheduler::~SC16IS740Scheduler() {
+}
+
+bool SC16IS740Scheduler::addPort(SC16IS740Base &port, uint8_t priority) {
+	if (numPorts >= MAX_PORTS) {
+		return false;
+	}
+	if (priority == 0) {
+		priority = 1;
+	}
+	port.managed = true;
+	port.scheduler = this;
+	ports[numPorts].port = &port;
+	ports[numPorts].priority = priority;
+	numPorts++;
+	return true;
+}
+
+void SC16IS740Scheduler::loop() {
+	std::lock_guard<SC16IS740Scheduler> guard(*this);
+	service();
+}
+
+bool SC16IS740Scheduler::service() {
+	if (numPorts == 0) {
+		return false;
+	}
+
+	bool busy = false;
+
+	// Each port gets up to priority service passes per round, but only while it moves data.
+	// The starting port rotates so equal priority ports share the bus fairly.
+	for(size_t ii = 0; ii < numPorts; ii++) {
+		PortEntry &entry = ports[(nextPort + ii) % numPorts];
+
+		for(uint8_t pass = 0; pass < entry.priority; pass++) {
+			if (!entry.port->serviceScheduled()) {
+				break;
+			}
+			busy = true;
+		}
+	}
+	nextPort = (nextPort + 1) % numPorts;
+
+	return busy;
+}
+
+bool SC16IS740Scheduler::startThread(os_thread_prio_t priority, size_t stackSize, unsigned long idleMs) {
+	if (threadRunning.load()) {
+		return false;
+	}
+	this->idleMs = idleMs;
+
+	// Set first, as the thread can start running before the constructor returns
+	threadRunning = true;
+	thread = new Thread("SC16IS740", threadFunction, this, priority, stackSize);
+	if (thread == 0) {
+		threadRunning = false;
+	}
+	return thread != 0;
+}
+
+// static
+void SC16IS740Scheduler::threadFunction(void *param) {
+	SC16IS740Scheduler *scheduler = (SC16IS740Scheduler *)param;
+
+	// Lets ports tell when a callback calls them on this thread
+	scheduler->workerThread = os_thread_current(NULL);
+
+	while(true) {
+		bool busy;
+		{
+			std::lock_guard<SC16IS740Scheduler> guard(*scheduler);
+			busy = scheduler->service();
+		}
+		if (busy) {
+			// Data moved, so more is likely waiting. This only lets threads at the same priority run;
+			// lower priority threads, including the application thread by default, run while this
+			// thread sleeps after a pass where nothing moved.
+			os_thread_yield();
+		}
+		else {
+			delay(scheduler->idleMs);
+		}
+	}
 }
@@ -3,6 +3,252 @@
 
 #include "Particle.h"
 
+#include <atomic>
+#include <mutex>
+
+class SC16IS740Scheduler;
+
+/**
+ * @brief Lock-free single-producer, single-consumer circular buffer of bytes
+ *
+ * The storage is provided by the caller, typically as a global or class member, so
+ * no heap allocation is done. One byte of the storage is reserved to distinguish full from empty.
+ *
+ * One context (an ISR, worker thread, or the application thread) may write while another reads
+ * without a lock. Only the producer may call write(), writeSpan(), and commitWrite(). Only the
+ * consumer may call read(), peek(), readSpan(), discard(), and commitRead(). setBuffer() and clear()
+ * must not be called while either side is active.
+ *
+ * The span functions expose contiguous regions of the storage so data can be moved directly to or
+ * from a bus transfer without an intermediate copy. A region ends at the end of the storage, so when
+ * the data wraps around there are two spans.
+ */
+class SC16IS740RingBuffer {
+public:
+	/**
+	 * @brief Set the storage for the buffer. Any data currently in the buffer is discarded.
+	 *
+	 * @param buf Pointer to the storage. Must remain valid for the life of this object.
+	 *
+	 * @param size Size of buf in bytes. The buffer holds at most size - 1 bytes.
+	 */
+	inline void setBuffer(uint8_t *buf, size_t size) { this->buf = buf; this->size = size; clear(); };
+
+	/**
+	 * @brief Returns true if storage has been assigned using setBuffer()
+	 */
+	inline bool isValid() const { return buf != 0; };
+
+	/**
+	 * @brief Discard all data in the buffer. Not safe while the producer or consumer is active.
+	 */
+	inline void clear() { head.store(0, std::memory_order_relaxed); tail.store(0, std::memory_order_release); };
+
+	/**
+	 * @brief Number of bytes that can be read from the buffer
+	 */
+	inline size_t available() const {
+		size_t h = head.load(std::memory_order_acquire);
+		size_t t = tail.load(std::memory_order_acquire);
+		return (h >= t) ? (h - t) : (size - t + h);
+	};
+
+	/**
+	 * @brief Number of bytes that can be written into the buffer
+	 */
+	inline size_t availableForWrite() const { return (size == 0) ? 0 : (size - 1 - available()); };
+
+	/**
+	 * @brief Contiguous region of data that can be read (consumer only)
+	 *
+	 * @param ptr Filled in with a pointer to the data
+	 *
+	 * @param offset Number of bytes past the oldest byte to start at. Use the length of the first
+	 * span to get the part that wrapped around to the beginning of the storage.
+	 *
+	 * @return The number of bytes at ptr. Call commitRead() or discard() after using them.
+	 */
+	inline size_t readSpan(const uint8_t *&ptr, size_t offset = 0) const {
+		size_t avail = available();
+		if (offset >= avail) {
+			return 0;
+		}
+		size_t t = tail.load(std::memory_order_relaxed) + offset;
+		if (t >= size) {
+			t -= size;
+		}
+		size_t n = avail - offset;
+		if (n > size - t) {
+			n = size - t;
+		}
+		ptr = &buf[t];
+		return n;
+	};
+
+	/**
+	 * @brief Remove bytes previously obtained from readSpan() (consumer only)
+	 */
+	inline void commitRead(size_t count) {
+		size_t t = tail.load(std::memory_order_relaxed) + count;
+		if (t >= size) {
+			t -= size;
+		}
+		tail.store(t, std::memory_order_release);
+	};
+
+	/**
+	 * @brief Contiguous region of free space that can be written (producer only)
+	 *
+	 * @param ptr Filled in with a pointer to the free space
+	 *
+	 * @return The number of bytes that can be stored at ptr. Call commitWrite() after filling them.
+	 */
+	inline size_t writeSpan(uint8_t *&ptr) {
+		size_t h = head.load(std::memory_order_relaxed);
+		size_t n = availableForWrite();
+		if (n > size - h) {
+			n = size - h;
+		}
+		ptr = &buf[h];
+		return n;
+	};
+
+	/**
+	 * @brief Make bytes stored in the space from writeSpan() available to the consumer (producer only)
+	 */
+	inline void commitWrite(size_t count) {
+		size_t h = head.load(std::memory_order_relaxed) + count;
+		if (h >= size) {
+			h -= size;
+		}
+		head.store(h, std::memory_order_release);
+	};
+
+	/**
+	 * @brief Remove a byte from the buffer
+	 *
+	 * @return a byte value 0 - 255 or -1 if the buffer is empty.
+	 */
+	inline int read() {
+		int c = peek();
+		if (c >= 0) {
+			commitRead(1);
+		}
+		return c;
+	};
+
+	/**
+	 * @brief Return the next byte in the buffer without removing it
+	 *
+	 * @return a byte value 0 - 255 or -1 if the buffer is empty.
+	 */
+	inline int peek() const {
+		const uint8_t *ptr;
+		return (readSpan(ptr) > 0) ? *ptr : -1;
+	};
+
+	/**
+	 * @brief Remove up to size bytes from the buffer
+	 *
+	 * @return The number of bytes copied into buffer
+	 */
+	inline size_t read(uint8_t *buffer, size_t size) {
+		size_t count = peek(buffer, size);
+		commitRead(count);
+		return count;
+	};
+
+	/**
+	 * @brief Copy up to size bytes from the buffer without removing them
+	 *
+	 * @return The number of bytes copied into buffer
+	 */
+	inline size_t peek(uint8_t *buffer, size_t size) const {
+		size_t count = 0;
+		const uint8_t *ptr;
+		size_t n;
+		while(count < size && (n = readSpan(ptr, count)) > 0) {
+			if (n > size - count) {
+				n = size - count;
+			}
+			memcpy(&buffer[count], ptr, n);
+			count += n;
+		}
+		return count;
+	};
+
+	/**
+	 * @brief Remove up to size bytes from the buffer without copying them
+	 */
+	inline void discard(size_t size) {
+		size_t avail = available();
+		commitRead((size < avail) ? size : avail);
+	};
+
+	/**
+	 * @brief Add up to size bytes to the buffer
+	 *
+	 * @return The number of bytes added. If the buffer fills, this will be less than size.
+	 */
+	inline size_t write(const uint8_t *buffer, size_t size) {
+		size_t count = 0;
+		uint8_t *ptr;
+		size_t n;
+		while(count < size && (n = writeSpan(ptr)) > 0) {
+			if (n > size - count) {
+				n = size - count;
+			}
+			memcpy(ptr, &buffer[count], n);
+			commitWrite(n);
+			count += n;
+		}
+		return count;
+	};
+
+protected:
+	uint8_t *buf = 0;
+	size_t size = 0;
+	std::atomic<size_t> head{0}; // Written by producer
+	std::atomic<size_t> tail{0}; // Written by consumer
+};
+
+/**
+ * @brief Bus activity counters for one SC16IS740 port
+ *
+ * These are always maintained and only cost an increment, unlike trace logging which affects timing.
+ * Use SC16IS740Base::getStats() to take a snapshot and resetStats() to clear them.
+ */
+struct SC16IS740Stats {
+	uint32_t registerReads = 0; //!< Single register reads, including RXLVL, TXLVL, LSR, and IIR
+	uint32_t registerWrites = 0; //!< Single register writes, including single-byte writes to THR
+	uint32_t bulkReads = 0; //!< Multi-byte transactions reading the RX FIFO
+	uint32_t bulkWrites = 0; //!< Multi-byte transactions writing the TX FIFO
+	uint32_t bytesIn = 0; //!< Bytes read from the RX FIFO
+	uint32_t bytesOut = 0; //!< Bytes written to the TX FIFO
+	uint32_t busErrors = 0; //!< Failed or short I2C transactions
+	uint32_t writeBlockedMicros = 0; //!< Time write() and writev() spent blocked waiting for room in the TX FIFO or queue
+	uint16_t rxFifoHighWater = 0; //!< Highest RXLVL seen. 64 means data was probably lost.
+	uint16_t rxBufferHighWater = 0; //!< Highest number of bytes in the receive buffer
+	uint16_t txBufferHighWater = 0; //!< Highest number of bytes in the transmit queue
+};
+
+/**
+ * @brief Results from SC16IS740Base::runLoopbackTest()
+ */
+struct SC16IS740LoopbackResult {
+	int baud = 0; //!< Requested baud rate
+	int actualBaud = 0; //!< Baud rate the divisor actually generates
+	uint32_t bytes = 0; //!< Number of bytes sent in the throughput test
+	uint32_t bytesVerified = 0; //!< Number of bytes received that matched the pattern
+	uint32_t errors = 0; //!< Bytes received that did not match, or were never received
+	uint32_t lineErrors = 0; //!< 1 if LSR reported an overrun, parity, or framing error during the test
+	uint32_t elapsedMs = 0; //!< Time for the throughput test
+	uint32_t bytesPerSec = 0; //!< Verified throughput
+	uint32_t minRoundTripMicros = 0; //!< Fastest single byte write() to read()
+	uint32_t avgRoundTripMicros = 0; //!< Average single byte write() to read()
+	uint32_t maxRoundTripMicros = 0; //!< Slowest single byte write() to read()
+};
+
 /**
  * @brief Library for using the SC16IS740 UART on the Particle platform
  * 
@@ -21,6 +267,248 @@ public:
 	 */
 	inline SC16IS740Base &withOscillatorHz(int value) { oscillatorHz = value; return *this; };
 
+	/**
+	 * @brief Set the maximum allowed baud rate error in tenths of a percent (default: 20, or 2%)
+	 *
+	 * begin() and setBaud() fail if the baud rate can't be generated within this tolerance.
+	 */
+	inline SC16IS740Base &withBaudTolerance(int permille) { baudTolerancePermille = permille; return *this; };
+
+	/**
+	 * @brief Returns the baud rate actually generated from the oscillator after begin() or setBaud()
+	 */
+	inline int getActualBaud() const { return actualBaud; };
+
+	/**
+	 * @brief Returns the prescaler (1 or 4) used for a baud rate
+	 *
+	 * This and the following functions are constexpr so fixed rates can be checked at compile time:
+	 *
+	 * static_assert(SC16IS740Base::isBaudValid(14745600, 921600), "baud rate not supported");
+	 */
+	static constexpr uint32_t prescalerForBaud(uint32_t oscHz, uint32_t baud) {
+		return (divisorForBaud(oscHz, baud, 1) > 0xffff) ? 4 : 1;
+	};
+
+	/**
+	 * @brief Returns the DLL/DLH divisor for a baud rate and prescaler, rounded to the nearest value
+	 */
+	static constexpr uint32_t divisorForBaud(uint32_t oscHz, uint32_t baud, uint32_t prescaler) {
+		return (baud == 0) ? 0 : ((oscHz / prescaler) + baud * 8) / (baud * 16);
+	};
+
+	/**
+	 * @brief Returns the baud rate that is actually generated for a requested baud rate, or 0 if not possible
+	 */
+	static constexpr uint32_t actualBaudFor(uint32_t oscHz, uint32_t baud) {
+		return (divisorForBaud(oscHz, baud, prescalerForBaud(oscHz, baud)) == 0) ? 0 :
+			(oscHz / prescalerForBaud(oscHz, baud)) / (divisorForBaud(oscHz, baud, prescalerForBaud(oscHz, baud)) * 16);
+	};
+
+	/**
+	 * @brief Returns the error between the requested and generated baud rate in tenths of a percent
+	 */
+	static constexpr uint32_t baudErrorPermille(uint32_t oscHz, uint32_t baud) {
+		return (baud == 0) ? 1000 :
+			((actualBaudFor(oscHz, baud) > baud) ? (actualBaudFor(oscHz, baud) - baud) : (baud - actualBaudFor(oscHz, baud))) * 1000 / baud;
+	};
+
+	/**
+	 * @brief Returns true if the baud rate can be generated within the tolerance
+	 */
+	static constexpr bool isBaudValid(uint32_t oscHz, uint32_t baud, uint32_t tolerancePermille = 20) {
+		return divisorForBaud(oscHz, baud, prescalerForBaud(oscHz, baud)) >= 1 &&
+			divisorForBaud(oscHz, baud, prescalerForBaud(oscHz, baud)) <= 0xffff &&
+			baudErrorPermille(oscHz, baud) <= tolerancePermille;
+	};
+
+	/**
+	 * @brief Sets the GPIO connected to the SC16IS740 IRQ output (default: -1, not used)
+	 *
+	 * The RX FIFO level interrupt is enabled and the IRQ line is checked before accessing the bus,
+	 * so available() and read() don't poll RXLVL when no data has arrived. Note that fewer bytes
+	 * than the RX trigger level (16) are only reported after the line has been idle for 4 character
+	 * times. The IRQ output is open-drain so the pin is configured as INPUT_PULLUP.
+	 *
+	 * You must call this before begin.
+	 */
+	inline SC16IS740Base &withInterruptPin(int pin) { intPin = pin; return *this; };
+
+	/**
+	 * @brief Adds a software receive buffer
+	 *
+	 * @param buf Buffer to store received data. Typically a global variable or class member.
+	 *
+	 * @param size Size of buf in bytes. It can hold size - 1 bytes of received data.
+	 *
+	 * The RX FIFO is always drained in bulk (up to readInternalMax() bytes per transaction) and
+	 * available(), read(), and peek() are served from RAM until it has been consumed. By default
+	 * an internal 64 byte read-ahead buffer is used. A larger buffer allows data to be moved out
+	 * of the hardware FIFO before it overruns; call loop() frequently when using one.
+	 *
+	 * You must call this before begin.
+	 */
+	inline SC16IS740Base &withRxBuffer(uint8_t *buf, size_t size) { rxBuffer.setBuffer(buf, size); return *this; };
+
+	/**
+	 * @brief Adds a software transmit queue
+	 *
+	 * @param buf Buffer to store data waiting to be sent. Typically a global variable or class member.
+	 *
+	 * @param size Size of buf in bytes. It can hold size - 1 bytes of data.
+	 *
+	 * When a transmit queue is used, write() copies the data into buf and returns immediately. The
+	 * queue is moved into the TX FIFO as space frees up when loop() is called. If an interrupt pin
+	 * is set, the THR interrupt is enabled while the queue is not empty and the bus is only accessed
+	 * when the chip reports room in the TX FIFO. blockOnOverrun() applies only when the queue is full.
+	 *
+	 * You must call this before begin.
+	 */
+	inline SC16IS740Base &withTxBuffer(uint8_t *buf, size_t size) { txBuffer.setBuffer(buf, size); return *this; };
+
+	/**
+	 * @brief Enable automatic RTS/CTS hardware flow control (default: disabled)
+	 *
+	 * @param haltLevel RX FIFO level at which RTS is deasserted, telling the remote side to stop sending.
+	 * 4 - 60 in multiples of 4.
+	 *
+	 * @param resumeLevel RX FIFO level at which RTS is asserted again. 0 - 56 in multiples of 4, and
+	 * must be less than haltLevel.
+	 *
+	 * With auto-CTS, the chip also stops transmitting when CTS is deasserted by the remote side. The
+	 * trigger levels are programmed into the TCR register. If withRS485() is used, RTS is the transceiver
+	 * direction, so only auto-CTS is enabled, whichever is called first.
+	 *
+	 * You must call this before begin.
+	 */
+	inline SC16IS740Base &withHardwareFlowControl(uint8_t haltLevel = 56, uint8_t resumeLevel = 16) {
+		efrValue |= EFR_ENHANCED | EFR_AUTO_CTS | ((efcrValue & EFCR_RTS_CONTROL) ? 0 : EFR_AUTO_RTS);
+		tcrValue = ((resumeLevel / 4) << 4) | ((haltLevel / 4) & 0x0f);
+		return *this;
+	};
+
+	/**
+	 * @brief Enable in-band XON/XOFF software flow control (default: disabled)
+	 *
+	 * @param mode A transmit mode ORed with a receive mode:
+	 * SW_FLOW_TX_XON1_XOFF1, SW_FLOW_TX_XON2_XOFF2, SW_FLOW_TX_XON12_XOFF12 (the chip sends XOFF when the
+	 * RX FIFO reaches haltLevel and XON when it drains to resumeLevel) and
+	 * SW_FLOW_RX_XON1_XOFF1, SW_FLOW_RX_XON2_XOFF2, SW_FLOW_RX_XON12_XOFF12 (the chip suspends transmission
+	 * when it receives XOFF and resumes on XON). Received XON/XOFF characters are not placed in the RX FIFO.
+	 *
+	 * @param haltLevel RX FIFO level at which XOFF is sent. 4 - 60 in multiples of 4.
+	 *
+	 * @param resumeLevel RX FIFO level at which XON is sent. 0 - 56 in multiples of 4, less than haltLevel.
+	 *
+	 * The characters default to XON = 0x11 (Ctrl-Q) and XOFF = 0x13 (Ctrl-S); use withXonXoffChars() to
+	 * change them. You must call this before begin.
+	 */
+	inline SC16IS740Base &withSoftwareFlowControl(uint8_t mode = SW_FLOW_TX_XON1_XOFF1 | SW_FLOW_RX_XON1_XOFF1, uint8_t haltLevel = 56, uint8_t resumeLevel = 16) {
+		efrValue = (efrValue & ~SW_FLOW_MASK) | EFR_ENHANCED | (mode & SW_FLOW_MASK);
+		tcrValue = ((resumeLevel / 4) << 4) | ((haltLevel / 4) & 0x0f);
+		return *this;
+	};
+
+	/**
+	 * @brief Set the characters used for software flow control
+	 *
+	 * You must call this before begin.
+	 */
+	inline SC16IS740Base &withXonXoffChars(uint8_t xon1, uint8_t xoff1, uint8_t xon2 = 0x11, uint8_t xoff2 = 0x13) {
+		xon1Char = xon1; xoff1Char = xoff1; xon2Char = xon2; xoff2Char = xoff2;
+		return *this;
+	};
+
+	/**
+	 * @brief Receive whole frames delimited by idle time, such as Modbus RTU (default: disabled)
+	 *
+	 * @param buf Buffer to assemble a received frame in. Typically a global variable or class member.
+	 *
+	 * @param size Size of buf in bytes. Bytes beyond this in a frame are discarded.
+	 *
+	 * The chip's RX time-out interrupt, which occurs when the line has been idle for 4 character times,
+	 * marks the end of a frame. Use frameAvailable() and readFrame() instead of available() and read().
+	 * While a frame is waiting to be read, new data is left in the hardware FIFO. An interrupt pin is
+	 * recommended; without one, IIR is polled. Note that the 4 character time-out is slightly longer than
+	 * the Modbus t3.5 gap, so a device that replies in under 4 character times will merge frames.
+	 *
+	 * You must call this before begin.
+	 */
+	inline SC16IS740Base &withFrameMode(uint8_t *buf, size_t size) { frameBuf = buf; frameBufSize = size; return *this; };
+
+	/**
+	 * @brief Enable automatic RS-485 transceiver direction control using the RTS pin (default: disabled)
+	 *
+	 * @param rtsHighWhenTransmitting true (default) if RTS should be high while transmitting, which is what
+	 * transceivers with an active-high driver enable (DE) such as the MAX485 need. false for RTS low while
+	 * transmitting.
+	 *
+	 * The chip switches RTS itself when the first bit goes out and when the stop bit of the last character
+	 * in the FIFO and shift register has been sent, so there is no need to toggle a GPIO around write() and
+	 * flush(). This uses the RTS pin, so it turns off the auto-RTS half of withHardwareFlowControl();
+	 * auto-CTS still works.
+	 *
+	 * You must call this before begin.
+	 */
+	inline SC16IS740Base &withRS485(bool rtsHighWhenTransmitting = true) {
+		efcrValue = (efcrValue & ~EFCR_RTS_INVERT) | EFCR_RTS_CONTROL | (rtsHighWhenTransmitting ? EFCR_RTS_INVERT : 0);
+		efrValue &= ~EFR_AUTO_RTS;
+		return *this;
+	};
+
+	/**
+	 * @brief Set the RX and TX FIFO interrupt trigger levels using the TLR register
+	 *
+	 * @param rxLevel Number of bytes in the RX FIFO that asserts the RX interrupt. 4 - 60 in multiples of 4.
+	 *
+	 * @param txLevel Number of spaces in the TX FIFO that asserts the THR interrupt. 4 - 60 in multiples of 4.
+	 *
+	 * This overrides the FCR trigger levels (16 for RX, 8 for TX). You must call this before begin.
+	 */
+	inline SC16IS740Base &withTriggerLevels(uint8_t rxLevel, uint8_t txLevel) {
+		efrValue |= EFR_ENHANCED;
+		tlrValue = ((rxLevel / 4) << 4) | ((txLevel / 4) & 0x0f);
+		return *this;
+	};
+
+	/**
+	 * @brief Set a function to call when data has been received (SC16IS740Scheduler only)
+	 *
+	 * @param callback Called with this port after new data has been moved into the receive buffer,
+	 * or a frame has been completed in frame mode.
+	 *
+	 * The callback runs on the scheduler's worker thread if SC16IS740Scheduler::startThread() is
+	 * used, otherwise from SC16IS740Scheduler::loop(). Other ports on the bus are not serviced
+	 * while it runs, so read the data and return. A blocking write(), flush(), or readBytes() from
+	 * the callback moves data on this port itself rather than waiting for the worker.
+	 */
+	inline SC16IS740Base &onReceive(std::function<void(SC16IS740Base &port)> callback) { receiveCallback = callback; return *this; };
+
+	/**
+	 * @brief Set a function to call when the transmit queue empties (SC16IS740Scheduler only)
+	 *
+	 * @param callback Called with this port after the last byte in the transmit queue (see withTxBuffer())
+	 * has been moved into the TX FIFO. The FIFO itself may still be sending; use flush() to wait for that.
+	 *
+	 * The callback runs in the same context as onReceive().
+	 */
+	inline SC16IS740Base &onTxEmpty(std::function<void(SC16IS740Base &port)> callback) { txEmptyCallback = callback; return *this; };
+
+	/**
+	 * @brief Take the bus lock of the SC16IS740Scheduler this port was added to
+	 *
+	 * The library takes the lock itself for every bus transaction and for multi-register changes
+	 * like setBaud(), so you only need this to group several of your own readRegister() and
+	 * writeRegister() calls. Does nothing if the port is not managed by a scheduler. Also works
+	 * with WITH_LOCK(port).
+	 */
+	void lock();
+
+	/**
+	 * @brief Release the bus lock taken by lock()
+	 */
+	void unlock();
+
 	/**
 	 * @brief Set up the chip. You must do this before reading or writing.
 	 *
@@ -29,11 +517,18 @@ public:
 	 * @param options The number of data bits, parity, and stop bits
 	 *
 	 * You can call begin more than once if you want to change the baud rate. The FIFOs are
-	 * cleared when you call begin.
+	 * cleared when you call begin. To change the baud rate or format while keeping buffered data,
+	 * use setBaud() or setFormat() instead.
 	 *
 	 * Available baud rates depend on your oscillator, but with a 1.8432 MHz oscillator, the following are supported:
 	 * 50, 75, 110, 134.5, 150, 300, 600, 1200, 1800, 2000, 2400, 3600, 4800, 7200, 9600, 19200, 38400, 57600, 115200
 	 *
+	 * The divisor is rounded to the nearest value, and the MCR divide-by-4 prescaler is used when the divisor
+	 * would not otherwise fit in 16 bits. If the resulting baud rate is more than the tolerance (default: 2%,
+	 * see withBaudTolerance()) from baudRate, false is returned and the chip is not configured. Use
+	 * getActualBaud() to find the baud rate that was achieved. For example, a 14.7456 MHz oscillator
+	 * generates 460800 and 921600 exactly.
+	 *
 	 * The valid options in standard number of bits; none=N, even=E, odd=O; number of stop bits format:
 	 * OPTIONS_8N1, OPTIONS_8E1, OPTIONS_8O1
 	 * OPTIONS_8N2, OPTIONS_8E2, OPTIONS_8O2
@@ -42,6 +537,35 @@ public:
 	 */
 	bool begin(int baudRate, uint8_t options = OPTIONS_8N1);
 
+	/**
+	 * @brief Change the baud rate without resetting the FIFOs
+	 *
+	 * @param baudRate The new baud rate
+	 *
+	 * Only the divisor registers that changed are written, along with LCR to select them, so this
+	 * is at most 4 register writes, plus MCR (and EFR, once) if the prescaler changes. Returns false
+	 * without changing anything if the baud rate is outside the tolerance. Data in the FIFOs and software buffers is kept, but any byte being
+	 * transmitted or received at the moment of the change may be corrupted. You must call begin() first.
+	 */
+	bool setBaud(int baudRate);
+
+	/**
+	 * @brief Change the number of data bits, parity, and stop bits without resetting the FIFOs
+	 *
+	 * @param options One of the OPTIONS constants, such as OPTIONS_8N1. See begin().
+	 *
+	 * This is a single LCR write, or nothing if the format is unchanged. You must call begin() first.
+	 */
+	bool setFormat(uint8_t options);
+
+	/**
+	 * @brief Services the software buffers. Call this from loop() when using withRxBuffer() or withTxBuffer().
+	 *
+	 * If an interrupt pin is set, the bus is only accessed when the SC16IS740 has
+	 * asserted IRQ.
+	 */
+	void loop();
+
 	/**
 	 * @brief Defines what should happen when calls to write()/print()/println()/printlnf() that would overrun the buffer.
 	 *
@@ -54,186 +578,1168 @@ public:
 	 * causing the new data to replace the old data. This option is provided when performance is more important than data
 	 * integrity.
 	 */
-	inline void blockOnOverrun(bool value = true) { writeBlocksWhenFull = value; };
+	inline void blockOnOverrun(bool value = true) { writeBlocksWhenFull = value; };
+
+	/**
+	 * @brief Returns the number of bytes available to read from the serial port
+	 *
+	 * This is a standard Arduino/Wiring method for Stream objects.
+	 */
+    virtual int available();
+
+	/**
+	 * @brief Returns the number of bytes available to write into the TX FIFO, or the software
+	 * transmit queue if withTxBuffer() is used
+	 */
+    virtual int availableForWrite();
+
+	/**
+	 * @brief Read a single byte from the serial port
+	 *
+	 * @return a byte value 0 - 255 or -1 if no data is available.
+	 *
+	 * This is a standard Arduino/Wiring method for Stream objects.
+	 */
+    virtual int read();
+
+	/**
+	 * @brief Read a single byte from the serial port, but do not remove it so it can be read again.
+	 *
+	 * @return a byte value 0 - 255 or -1 if no data is available.
+	 *
+	 * This is a standard Arduino/Wiring method for Stream objects.
+	 */
+    virtual int peek();
+
+	/**
+	 * @brief Block until all serial data is sent.
+	 *
+	 * This is a standard Arduino/Wiring method for Stream objects.
+	 *
+	 * This waits until the transmit queue, the TX FIFO, and the transmit shift register are all
+	 * empty (LSR TEMT), so when it returns the stop bit of the last character has been sent and
+	 * the line is idle. This is the point where a half-duplex or RS-485 link can be turned around.
+	 */
+    virtual void flush();
+
+	/**
+	 * @brief Block until all serial data is sent, with a timeout
+	 *
+	 * @param timeoutMs Maximum time to wait in milliseconds, or 0 to wait forever
+	 *
+	 * @return true if all data was sent, false if the timeout occurred first, for example because
+	 * flow control is holding off transmission.
+	 */
+	bool flush(unsigned long timeoutMs);
+
+	/**
+	 * @brief Write a single byte to the serial port.
+	 *
+	 * @param c The byte to write. Can write binary or text data.
+	 *
+	 * This is a standard Arduino/Wiring method for Stream objects.
+	 */
+    virtual size_t write(uint8_t c);
+
+	/**
+	 * @brief Write a multiple bytes to the serial port.
+	 *
+	 * @param buffer The buffer to write. Can write binary or text data.
+	 *
+	 * @param size The number of bytes to write
+	 *
+	 * @return The number of bytes written.
+	 *
+	 * This is faster than writing a single byte at time because up to 32 bytes of data can
+	 * be sent or received in an I2C transaction, greatly reducing overhead.
+	 */
+	virtual size_t write(const uint8_t *buffer, size_t size);
+
+	/**
+	 * @brief One buffer in a scatter-gather write using writev()
+	 */
+	struct WriteVec {
+		const uint8_t *buffer; //!< Data to write
+		size_t size; //!< Number of bytes
+	};
+
+	/**
+	 * @brief Write multiple buffers, such as a header, payload, and CRC, as one stream of bytes
+	 *
+	 * @param vec Array of buffers to write, in order
+	 *
+	 * @param count Number of elements in vec
+	 *
+	 * @return The number of bytes written
+	 *
+	 * The buffers are packed into as few bus transactions as the TX FIFO space and writeInternalMax()
+	 * allow, instead of one or more transactions per buffer. The data is not copied into an intermediate
+	 * buffer unless a transmit queue or SPI DMA is used. blockOnOverrun() applies as for write().
+	 */
+	size_t writev(const WriteVec *vec, size_t count);
+
+	/**
+	 * @brief Read a multiple bytes to the serial port.
+	 *
+	 * @param buffer The buffer to read data into. It will not be null terminated.
+	 *
+	 * @param size The maximum number of bytes to read (buffer size)
+	 *
+	 * @return The number of bytes actually read or -1 if there are no bytes available to read.
+	 *
+	 * This is faster than reading a single byte at time because up to 32 bytes of data can
+	 * be sent or received in an I2C transaction, greatly reducing overhead.
+	 */
+	virtual int read(uint8_t *buffer, size_t size);
+
+	/**
+	 * @brief Read bytes into buffer, waiting up to the Stream timeout (setTimeout()) for each byte
+	 *
+	 * This hides Stream::readBytes(). Data is moved from the RX FIFO in readInternalMax() sized
+	 * transactions and copied out of the receive buffer in bulk, instead of a separate read() for
+	 * each character. While waiting for data, the bus is polled about once per expected chunk
+	 * instead of continuously.
+	 *
+	 * @return The number of bytes placed in buffer (0 means no valid data found)
+	 */
+	size_t readBytes(char *buffer, size_t length);
+
+	/**
+	 * @brief Read bytes into buffer until terminator is found, waiting up to the Stream timeout for each byte
+	 *
+	 * This hides Stream::readBytesUntil(). The terminator is removed from the stream but not stored in
+	 * buffer. Data after the terminator is left in the receive buffer for the next call.
+	 *
+	 * @return The number of bytes placed in buffer (0 means no valid data found)
+	 */
+	size_t readBytesUntil(char terminator, char *buffer, size_t length);
+
+	/**
+	 * @brief Reads data from the stream until the target string is found. Hides Stream::find().
+	 *
+	 * @return true if target string is found, false if timed out (see setTimeout)
+	 */
+	bool find(char *target);
+
+	/**
+	 * @brief Reads data from the stream until the target string of length bytes is found. Hides Stream::find().
+	 */
+	bool find(char *target, size_t length);
+
+	/**
+	 * @brief Reads data from the stream until the target or terminator string is found. Hides Stream::findUntil().
+	 */
+	bool findUntil(char *target, char *terminator);
+
+	/**
+	 * @brief Reads data from the stream until the target or terminator string is found. Hides Stream::findUntil().
+	 */
+	bool findUntil(char *target, size_t targetLen, char *terminate, size_t termLen);
+
+	/**
+	 * @brief Returns the first valid (long) integer value from the current position. Hides Stream::parseInt().
+	 */
+	long parseInt();
+
+	/**
+	 * @brief Returns the first valid float value from the current position. Hides Stream::parseFloat().
+	 */
+	float parseFloat();
+
+	/**
+	 * @brief Returns a snapshot of the bus activity counters for this port
+	 */
+	SC16IS740Stats getStats() const;
+
+	/**
+	 * @brief Clears the bus activity counters for this port
+	 */
+	void resetStats();
+
+	/**
+	 * @brief Measure this port's bus path using the chip's internal loopback
+	 *
+	 * @param baud The baud rate to test. The previous baud rate is restored afterwards.
+	 *
+	 * @param size The number of bytes to send in the throughput test
+	 *
+	 * @param result Filled in with the results
+	 *
+	 * @return true if the test ran with no errors. Returns false immediately if the baud rate can't be
+	 * generated, or the port is managed by SC16IS740Scheduler or in frame mode.
+	 *
+	 * MCR loopback connects TX to RX inside the chip and disconnects the TX and RX pins, so no external
+	 * wiring is needed and nothing is sent on the line. The round-trip time of single bytes is measured
+	 * first, then a pattern of size bytes is sent and verified, using the same write() and read() path an
+	 * application uses. The I2C or SPI clock speed is whatever the bus is currently set to. You must
+	 * call begin() first. The FIFOs and software buffers are cleared before and after the test.
+	 */
+	bool runLoopbackTest(int baud, size_t size, SC16IS740LoopbackResult &result);
+
+	/**
+	 * @brief Returns true if a complete frame has been received (withFrameMode() only)
+	 */
+	bool frameAvailable();
+
+	/**
+	 * @brief Read a complete frame (withFrameMode() only)
+	 *
+	 * @param buffer Buffer to copy the frame into
+	 *
+	 * @param size Size of buffer. If the frame is larger, it is truncated.
+	 *
+	 * @param timestamp If not NULL, filled in with the millis() value when the last byte of the frame arrived.
+	 * With an interrupt pin this is estimated from the time of the last IRQ edge: the RX time-out for frames
+	 * that end below the RX trigger level, or the FIFO reaching the trigger level, assuming the bytes after
+	 * it were sent back-to-back as Modbus RTU requires. Either way it doesn't depend on how soon the frame
+	 * was serviced. Without an interrupt pin, it's only accurate if frameAvailable() or the scheduler runs
+	 * promptly after the frame ends.
+	 *
+	 * @return The number of bytes copied into buffer, or 0 if no frame is available
+	 */
+	size_t readFrame(uint8_t *buffer, size_t size, unsigned long *timestamp = NULL);
+
+	/**
+	 * @brief Write a frame, first waiting for the inter-frame gap since the previous frame
+	 *
+	 * The gap is 3.5 character times, or 1750 microseconds above 19200 baud, as in Modbus RTU. It is
+	 * measured from the end of the last frame sent with writeFrame() or received with readFrame().
+	 *
+	 * @return The number of bytes written
+	 */
+	size_t writeFrame(const uint8_t *buffer, size_t size);
+
+
+    /**
+     * @brief Read a register
+     *
+     * @param reg The register number to read. Note that this should be the register 0 - 16, before shifting for channel.
+     */
+	virtual uint8_t readRegister(uint8_t reg) = 0;
+
+	/**
+     * @brief Write a register
+     *
+     * @param reg The register number to write. Note that this should be the register 0 - 16, before shifting for channel.
+     *
+     * @param value The value to write
+     */
+	virtual bool writeRegister(uint8_t reg, uint8_t value) = 0;
+
+
+	/**
+	 * @brief Longest wait between polls for received data, in characters
+	 *
+	 * Leaves 16 bytes of the 64 byte RX FIFO for data that arrives while it's being drained.
+	 */
+	static const size_t RX_POLL_MAX_CHARS = 48;
+
+	static const uint8_t WORK_RX = 0x01;
+	static const uint8_t WORK_TX = 0x02;
+
+	static const uint8_t OPTIONS_8N1 = 0b000011;
+	static const uint8_t OPTIONS_8E1 = 0b011011;
+	static const uint8_t OPTIONS_8O1 = 0b001011;
+
+	static const uint8_t OPTIONS_8N2 = 0b000111;
+	static const uint8_t OPTIONS_8E2 = 0b011111;
+	static const uint8_t OPTIONS_8O2 = 0b001111;
+
+	static const uint8_t OPTIONS_7N1 = 0b000010;
+	static const uint8_t OPTIONS_7E1 = 0b011010;
+	static const uint8_t OPTIONS_7O1 = 0b001010;
+
+	static const uint8_t OPTIONS_7N2 = 0b000110;
+	static const uint8_t OPTIONS_7E2 = 0b011110;
+	static const uint8_t OPTIONS_7O2 = 0b001110;
+
+	static const uint8_t RHR_THR_REG = 0x00;
+	static const uint8_t IEF_REG = 0x01;
+	static const uint8_t FCR_IIR_REG = 0x02;
+	static const uint8_t LCR_REG = 0x03;
+	static const uint8_t MCR_REG = 0x04;
+	static const uint8_t LSR_REG = 0x05;
+	static const uint8_t MSR_REG = 0x06;
+	static const uint8_t SPR_REG = 0x07;
+	static const uint8_t TXLVL_REG = 0x08;
+	static const uint8_t RXLVL_REG = 0x09;
+	static const uint8_t IODIR_REG = 0x0a;
+	static const uint8_t IOSTATE_REG = 0x0b;
+	static const uint8_t IOINTENA_REG = 0x0c;
+	static const uint8_t IOCONTROL_REG = 0x0e;
+	static const uint8_t EFCR_REG = 0x0f;
+
+	// IER (IEF_REG) bits
+	static const uint8_t IER_RHR = 0x01; // RX data available and RX time-out interrupt
+	static const uint8_t IER_THR = 0x02;
+	static const uint8_t IER_LINE_STATUS = 0x04;
+	static const uint8_t IER_MODEM_STATUS = 0x08;
+
+	// FCR (FCR_IIR_REG, write only) bits
+	static const uint8_t FCR_FIFO_ENABLE = 0x01;
+	static const uint8_t FCR_RX_FIFO_RESET = 0x02;
+	static const uint8_t FCR_TX_FIFO_RESET = 0x04;
+	static const uint8_t FCR_RX_TRIGGER_16 = 0x40;
+
+	// IIR (FCR_IIR_REG, read only) bits
+	static const uint8_t IIR_NO_INTERRUPT = 0x01;
+	static const uint8_t IIR_SOURCE_MASK = 0x3e;
+	static const uint8_t IIR_THR = 0x02;
+	static const uint8_t IIR_RHR = 0x04;
+	static const uint8_t IIR_RX_TIMEOUT = 0x0c;
+
+	// Special register block
+	static const uint8_t LCR_SPECIAL_START = 0x80;
+	static const uint8_t LCR_SPECIAL_END = 0xbf;
+	static const uint8_t DLL_REG = 0x00;
+	static const uint8_t DLH_REG = 0x01;
+
+	// Enhanced register set
+	static const uint8_t EFR_REG = 0x02;
+	static const uint8_t XON1_REG = 0x04;
+	static const uint8_t XON2_REG = 0x05;
+	static const uint8_t XOFF1_REG = 0x06;
+	static const uint8_t XOFF2_REG = 0x07;
+
+	// TCR and TLR are accessible when EFR[4] = 1 and MCR[2] = 1
+	static const uint8_t TCR_REG = 0x06;
+	static const uint8_t TLR_REG = 0x07;
+
+	// EFR bits
+	static const uint8_t EFR_ENHANCED = 0x10;
+	static const uint8_t EFR_AUTO_RTS = 0x40;
+	static const uint8_t EFR_AUTO_CTS = 0x80;
+
+	// EFR[3:0] software flow control modes, used with withSoftwareFlowControl()
+	static const uint8_t SW_FLOW_TX_XON1_XOFF1 = 0x08;
+	static const uint8_t SW_FLOW_TX_XON2_XOFF2 = 0x04;
+	static const uint8_t SW_FLOW_TX_XON12_XOFF12 = 0x0c;
+	static const uint8_t SW_FLOW_RX_XON1_XOFF1 = 0x02;
+	static const uint8_t SW_FLOW_RX_XON2_XOFF2 = 0x01;
+	static const uint8_t SW_FLOW_RX_XON12_XOFF12 = 0x03;
+	static const uint8_t SW_FLOW_MASK = 0x0f;
+
+	// EFCR bits
+	static const uint8_t EFCR_RX_DISABLE = 0x02;
+	static const uint8_t EFCR_TX_DISABLE = 0x04;
+	static const uint8_t EFCR_RTS_CONTROL = 0x10; // RTS is the RS-485 transmitter enable
+	static const uint8_t EFCR_RTS_INVERT = 0x20; // RTS = 1 during transmission
+
+	// LSR bits
+	static const uint8_t LSR_DATA_READY = 0x01;
+	static const uint8_t LSR_OVERRUN_ERROR = 0x02;
+	static const uint8_t LSR_PARITY_ERROR = 0x04;
+	static const uint8_t LSR_FRAMING_ERROR = 0x08;
+	static const uint8_t LSR_THRE = 0x20; // TX FIFO empty
+	static const uint8_t LSR_TEMT = 0x40; // TX FIFO and transmit shift register empty
+
+	// MCR bits
+	static const uint8_t MCR_TCR_TLR_ENABLE = 0x04;
+	static const uint8_t MCR_LOOPBACK = 0x10;
+	static const uint8_t MCR_CLOCK_DIV4 = 0x80; // Writable only when EFR[4] = 1
+
+
+protected:
+	friend class SC16IS740Scheduler;
+
+	/**
+	 * @brief Called from begin to allow things like wire.begin()
+	 */
+	virtual bool preBegin() { return true; };
+
+	/**
+	 * @brief Maximum number of bytes that can be read by readInternal
+	 *
+	 * Implemented by the transport. The value is read once in begin() and cached, so an override
+	 * must return a constant that is valid before begin() is called. It's limited to 64, the FIFO size.
+	 */
+	virtual size_t readInternalMax() const = 0;
+
+	/**
+	 * @brief Internal function to read data
+	 *
+	 * It can only read readInternalMax() bytes at a time.
+	 */
+	virtual bool readInternal(uint8_t *buffer, size_t size) = 0;
+
+	/**
+	 * @brief Maximum number of bytes that can be written by writeInternal
+	 *
+	 * Implemented by the transport. The value is read once in begin() and cached, so an override
+	 * must return a constant that is valid before begin() is called. It's limited to 64, the FIFO size.
+	 */
+	virtual size_t writeInternalMax() const = 0;
+
+	/**
+	 * @brief Internal function to write data
+	 *
+	 * It can only write writeInternalMax() bytes at a time.
+	 */
+	virtual bool writeInternal(const uint8_t *buffer, size_t size) = 0;
+
+	/**
+	 * @brief Internal function to write several buffers to the TX FIFO in a single transaction
+	 *
+	 * The total size must not exceed writeInternalMax(). The default implementation copies the data
+	 * and calls writeInternal().
+	 */
+	virtual bool writeInternalVec(const WriteVec *vec, size_t count);
+
+	/**
+	 * @brief Maximum number of buffers writev() packs into one writeInternalVec() call
+	 */
+	static const size_t WRITEV_MAX_PIECES = 8;
+
+	/**
+	 * @brief Moves data from the RX FIFO into rxBuffer
+	 *
+	 * When using an interrupt pin, does nothing unless IRQ has been asserted. Virtual so SC16IS740T
+	 * can replace it with a copy of serviceRxImpl() that calls its transport directly.
+	 */
+	virtual void serviceRx();
+
+	/**
+	 * @brief Read or peek a byte from the receive buffer, waiting up to the Stream timeout
+	 *
+	 * Used by the Stream helper overrides in place of Stream::timedRead() and timedPeek().
+	 */
+	int timedReadBuffered(bool peekOnly = false);
+
+	/**
+	 * @brief Wait before polling for more received data
+	 *
+	 * @param chars Number of characters expected. Without an interrupt pin, the wait is for up to
+	 * readInternalMax() characters so each poll can move a full chunk, but never more than
+	 * RX_POLL_MAX_CHARS so the FIFO can't fill before it's drained. With an interrupt pin, checking
+	 * for data is free, so the wait is one character time.
+	 *
+	 * @param maxMicros The time left before the Stream timeout. The wait never exceeds this.
+	 *
+	 * @param pollMicros Time already spent since the last poll started, such as draining the FIFO.
+	 * It's subtracted from the wait so polls are evenly spaced.
+	 */
+	void waitForRx(size_t chars, unsigned long maxMicros, unsigned long pollMicros = 0);
+
+	/**
+	 * @brief Skip to the next digit or minus sign, like Stream::peekNextDigit()
+	 */
+	int peekNextDigitBuffered();
+
+	/**
+	 * @brief Moves data from the RX FIFO into frameBuf, detecting the end of frame from the RX time-out interrupt
+	 */
+	void serviceFrame();
+
+	/**
+	 * @brief Returns the minimum idle time between frames in microseconds
+	 */
+	unsigned long interFrameMicros() const;
+
+	/**
+	 * @brief Moves data from txBuffer into the TX FIFO
+	 *
+	 * When using an interrupt pin, does nothing while the THR interrupt is enabled but IRQ is not asserted.
+	 */
+	virtual void serviceTx();
+
+	/**
+	 * @brief Returns the time to transmit one character in microseconds at the current baud rate and format
+	 */
+	unsigned long charTimeMicros() const;
+
+	/**
+	 * @brief Wait for about the time it takes to transmit chars characters
+	 *
+	 * Used instead of polling TXLVL every millisecond when waiting for room in the TX FIFO. Short
+	 * waits at high baud rates use delayMicroseconds(); longer ones use delay() so other threads can run.
+	 */
+	void waitForTxDrain(size_t chars);
+
+	/**
+	 * @brief waitForTxDrain() from a blocking write(), adding the time actually spent to writeBlockedMicros
+	 */
+	void blockForTxDrain(size_t chars);
+
+	/**
+	 * @brief Wait for us microseconds, using delay() for waits of 1 ms or more
+	 */
+	void waitMicros(unsigned long us);
+
+	/**
+	 * @brief Returns the free space in the TX FIFO, reading TXLVL only if txCredit is less than needed
+	 *
+	 * @param needed The number of bytes the caller would like to write
+	 */
+	size_t txFifoSpace(size_t needed);
+
+	/**
+	 * @brief Implementation of serviceRx(), serviceTx(), txFifoSpace(), and write(buffer, size)
+	 *
+	 * @param Port The class whose readRegister(), readInternal(), writeInternal(), writeInternalVec(),
+	 * readLimit(), and writeLimit() are called. SC16IS740Base uses itself, so bus access goes through the
+	 * virtual functions. SC16IS740T uses itself, where they're final or hide the ones here, so the calls
+	 * are resolved at compile time.
+	 */
+	template<class Port> void serviceRxImpl();
+	template<class Port> void serviceTxImpl();
+	template<class Port> size_t txFifoSpaceImpl(size_t needed);
+	template<class Port> size_t writeImpl(const uint8_t *buffer, size_t size);
+
+	/**
+	 * @brief The number of bytes readInternal() can transfer, readInternalMax() as cached in begin()
+	 */
+	inline size_t readLimit() const { return readMax; };
+
+	/**
+	 * @brief The number of bytes writeInternal() can transfer, writeInternalMax() as cached in begin()
+	 */
+	inline size_t writeLimit() const { return writeMax; };
+
+	/**
+	 * @brief Write a register in the enhanced register set (EFR, XON1, etc.) and restore LCR from its shadow copy
+	 */
+	bool writeEnhancedRegister(uint8_t reg, uint8_t value);
+
+	/**
+	 * @brief Write a general register only if the value differs from its shadow copy
+	 *
+	 * @param reg The register number
+	 *
+	 * @param shadow The shadow copy of the register, updated to value
+	 *
+	 * @param value The new value
+	 */
+	bool writeShadowed(uint8_t reg, uint8_t &shadow, uint8_t value);
+
+	/**
+	 * @brief Determines what work the port needs without reading the FIFO levels
+	 *
+	 * @return WORK_RX and/or WORK_TX bits
+	 *
+	 * Uses the IRQ pin if available, otherwise a single IIR read. Used by SC16IS740Scheduler. RX work
+	 * is not reported while the receive buffer is full or a received frame has not been read, and the
+	 * IIR read is skipped then unless the THR interrupt is enabled.
+	 */
+	uint8_t pendingWork();
+
+	/**
+	 * @brief Does one service pass if pendingWork() reports any
+	 *
+	 * @return true if bytes were moved between the FIFOs and the software buffers, or a frame completed
+	 */
+	bool serviceScheduled();
+
+	/**
+	 * @brief Returns true if a scheduler worker thread other than the calling thread services this port,
+	 * so the caller must not move the transmit queue itself
+	 *
+	 * False in onReceive() and onTxEmpty() callbacks on the worker thread, so a blocking write() or flush()
+	 * there services the port itself instead of waiting for the thread that's running it.
+	 */
+	bool workerRunning() const;
+
+	/**
+	 * @brief Returns true if called from the worker thread of the scheduler this port was added to
+	 */
+	bool onWorkerThread() const;
+
+	/**
+	 * @brief Resets the hardware FIFOs and clears the software buffers
+	 */
+	void resetFifos();
+
+	/**
+	 * @brief Byte at index in the runLoopbackTest() pattern
+	 *
+	 * Not a simple counter so that a dropped or duplicated byte is detected.
+	 */
+	static inline uint8_t loopbackPattern(size_t index) { return (uint8_t) ((index * 151) ^ (index >> 8)); };
+
+	/**
+	 * @brief Number of single bytes timed by runLoopbackTest()
+	 */
+	static const size_t LOOPBACK_LATENCY_SAMPLES = 16;
+
+	/**
+	 * @brief Maximum bytes in flight in runLoopbackTest(), less than the 64 byte RX FIFO so it can't overrun
+	 */
+	static const size_t LOOPBACK_MAX_IN_FLIGHT = 48;
+
+	/**
+	 * @brief Raises a high-water mark counter to value if it is higher
+	 */
+	static inline void updateHighWater(uint16_t &mark, size_t value) { if (value > mark) { mark = (uint16_t) value; } };
+
+	/**
+	 * @brief Returns true if IER interrupts are used, either with an IRQ pin or by polling IIR
+	 */
+	inline bool usesInterrupts() const { return intPin >= 0 || managed || frameBuf != 0; };
+
+	/**
+	 * @brief Enables or disables the THR (TX FIFO space available) interrupt
+	 */
+	void setTxInterrupt(bool enable);
+
+	/**
+	 * @brief Returns the RX FIFO trigger level set by begin() or withTriggerLevels()
+	 */
+	inline size_t rxTriggerLevel() const { return (tlrValue & 0xf0) ? (tlrValue >> 4) * 4 : 16; };
+
+	/**
+	 * @brief GPIO interrupt handler for intPin. Only records the time and sets a flag; bus access is not allowed from an ISR.
+	 */
+	void interruptHandler();
+
+
+	SC16IS740Stats stats;
+
+	size_t readMax = 32; //!< readInternalMax(), cached in begin()
+	size_t writeMax = 31; //!< writeInternalMax(), cached in begin()
+
+	int oscillatorHz = 1843200;
+	int intPin = -1;
+	volatile bool interruptPending = false;
+	volatile unsigned long interruptMicros = 0; // micros() at the last IRQ falling edge
+	bool managed = false; // Bus access is done by SC16IS740Scheduler, not read/write
+	SC16IS740Scheduler *scheduler = 0; // Scheduler that owns the bus lock when managed
+	std::function<void(SC16IS740Base &port)> receiveCallback;
+	std::function<void(SC16IS740Base &port)> txEmptyCallback;
+	// Shadow copies of write-mostly registers, valid after begin()
+	int baudRate = 0;
+	int actualBaud = 0;
+	int baudTolerancePermille = 20;
+	uint16_t divisor = 0;
+	uint8_t lcrValue = 0;
+	uint8_t fcrValue = 0;
+	uint8_t ierValue = 0;
+	uint8_t efrValue = 0;
+	uint8_t mcrValue = 0;
+	uint8_t efcrValue = 0;
+	uint8_t tcrValue = 0;
+	uint8_t tlrValue = 0;
+	uint8_t xon1Char = 0x11;
+	uint8_t xoff1Char = 0x13;
+	uint8_t xon2Char = 0x11;
+	uint8_t xoff2Char = 0x13;
+	size_t txCredit = 0; // Known free space in the TX FIFO, decremented on each write
+	SC16IS740RingBuffer rxBuffer;
+	uint8_t readAheadBuf[65]; // Default rxBuffer storage, holds one full 64 byte FIFO
+
+	uint8_t *frameBuf = 0;
+	size_t frameBufSize = 0;
+	size_t frameLen = 0;
+	std::atomic<bool> frameReady{false}; // Set by serviceFrame(), cleared by readFrame(), which may be on different threads
+	unsigned long frameTimestamp = 0;
+	unsigned long frameLastByteMicros = 0; // Estimated micros() when the last byte of the current frame arrived
+	size_t frameLeftInFifo = 0; // Bytes serviceFrame() left in the RX FIFO at the last drain
+	unsigned long lineIdleMicros = 0; // micros() value when the line last became idle
+	SC16IS740RingBuffer txBuffer;
+	bool writeBlocksWhenFull = true;
+};
+
+template<class Port>
+void SC16IS740Base::serviceRxImpl() {
+	Port &port = static_cast<Port &>(*this);
+
+	if (frameBuf) {
+		serviceFrame();
+		return;
+	}
+
+	if (intPin >= 0) {
+		// Also check the level in case an edge was missed while the line was held low
+		if (!interruptPending && pinReadFast(intPin) != LOW) {
+			// No data has arrived, don't touch the bus
+			return;
+		}
+		interruptPending = false;
+	}
+
+	uint8_t buf[64];
+
+	// Read RXLVL once and drain that many bytes in readLimit() sized transactions.
+	// Anything that arrives in the meantime is picked up on the next call.
+	size_t avail = port.readRegister(RXLVL_REG);
+	updateHighWater(stats.rxFifoHighWater, avail);
+
+	while(avail > 0) {
+		size_t count = rxBuffer.availableForWrite();
+		if (count == 0) {
+			// Leave the remaining data in the hardware FIFO
+			break;
+		}
+		if (count > avail) {
+			count = avail;
+		}
+		if (count > port.readLimit()) {
+			count = port.readLimit();
+		}
+
+		// Read directly into rxBuffer unless the transfer would wrap around the end of it
+		uint8_t *dst;
+		if (rxBuffer.writeSpan(dst) >= count) {
+			if (!port.readInternal(dst, count)) {
+				break;
+			}
+			rxBuffer.commitWrite(count);
+		}
+		else {
+			if (count > sizeof(buf)) {
+				count = sizeof(buf);
+			}
+			if (!port.readInternal(buf, count)) {
+				break;
+			}
+			rxBuffer.write(buf, count);
+		}
+		avail -= count;
+	}
+	updateHighWater(stats.rxBufferHighWater, rxBuffer.available());
+}
+
+template<class Port>
+void SC16IS740Base::serviceTxImpl() {
+	Port &port = static_cast<Port &>(*this);
+
+	if (!txBuffer.isValid()) {
+		return;
+	}
+
+	if (txBuffer.available() == 0) {
+		if (ierValue & IER_THR) {
+			setTxInterrupt(false);
+		}
+		return;
+	}
+
+	if (intPin >= 0 && (ierValue & IER_THR) != 0 && pinReadFast(intPin) != LOW) {
+		// TX FIFO is still above the trigger level, don't touch the bus
+		return;
+	}
+
+	while(txBuffer.available() > 0) {
+		size_t count = txBuffer.available();
+		if (count > port.writeLimit()) {
+			count = port.writeLimit();
+		}
+		size_t avail = txFifoSpaceImpl<Port>(count);
+		if (avail == 0) {
+			break;
+		}
+		if (count > avail) {
+			count = avail;
+		}
+
+		// Send directly from txBuffer, in two pieces if the data wraps around the end of it
+		WriteVec vec[2];
+		size_t numPieces = 0;
+		for(size_t offset = 0; offset < count && numPieces < 2; numPieces++) {
+			size_t n = txBuffer.readSpan(vec[numPieces].buffer, offset);
+			if (n > count - offset) {
+				n = count - offset;
+			}
+			vec[numPieces].size = n;
+			offset += n;
+		}
+		bool result = (numPieces == 1) ? port.writeInternal(vec[0].buffer, vec[0].size) : port.writeInternalVec(vec, numPieces);
+		if (!result) {
+			// Leave the data in txBuffer to try again later
+			break;
+		}
+		txCredit -= count;
+		txBuffer.commitRead(count);
+	}
+
+	if (usesInterrupts()) {
+		bool wantInterrupt = (txBuffer.available() > 0);
+		if (wantInterrupt != ((ierValue & IER_THR) != 0)) {
+			setTxInterrupt(wantInterrupt);
+		}
+	}
+}
+
+template<class Port>
+size_t SC16IS740Base::txFifoSpaceImpl(size_t needed) {
+	if (txCredit < needed) {
+		// The estimate only decreases between reads of TXLVL, so it never over-counts
+		txCredit = static_cast<Port &>(*this).readRegister(TXLVL_REG);
+	}
+	return txCredit;
+}
+
+template<class Port>
+size_t SC16IS740Base::writeImpl(const uint8_t *buffer, size_t size) {
+	Port &port = static_cast<Port &>(*this);
+	size_t written = 0;
+	bool done = false;
+
+	if (txBuffer.isValid()) {
+		while(true) {
+			written += txBuffer.write(&buffer[written], size - written);
+			updateHighWater(stats.txBufferHighWater, txBuffer.available());
+			if (!managed) {
+				serviceTxImpl<Port>();
+			}
+			if (written == size || !writeBlocksWhenFull) {
+				break;
+			}
+			if (managed && !workerRunning()) {
+				// Without a worker, or on the worker itself in a callback, nothing else moves the queue while this waits
+				std::lock_guard<SC16IS740Base> guard(*this);
+				serviceTxImpl<Port>();
+			}
+			// Wait for about as much as the queue can move into the FIFO
+			blockForTxDrain(size - written < port.writeLimit() ? size - written : port.writeLimit());
+		}
+		return written;
+	}
+
+	while(size > 0 && !done) {
+		size_t count = size;
+		if (count > port.writeLimit()) {
+			count = port.writeLimit();
+		}
+
+		if (writeBlocksWhenFull) {
+			size_t avail;
+			while((avail = txFifoSpaceImpl<Port>(count)) < count) {
+				blockForTxDrain(count - avail);
+			}
+		}
+		else {
+			size_t avail = txFifoSpaceImpl<Port>(count);
+			if (count > avail) {
+				count = avail;
+				done = true;
+			}
+		}
+
+		if (count == 0) {
+			break;
+		}
+
+		if (!port.writeInternal(buffer, count)) {
+			// Failed to write
+			break;
+		}
+		txCredit -= count;
+		buffer += count;
+		size -= count;
+		written += count;
+	}
+
+	return written;
+}
+
+/**
+ * @brief Register and FIFO access over I2C, used by SC16IS740 and SC16IS740T<SC16IS740I2CTransport>
+ *
+ * None of the functions are virtual. The caller holds the port lock and passes the port's statistics.
+ */
+class SC16IS740I2CTransport {
+public:
+	/**
+	 * @brief Construct the transport
+	 *
+	 * @param wire The I2C port to use, typically Wire.
+	 *
+	 * @param addr The address you've set using the A0 and A1 pins, 0-3. This will be converted to the
+	 * appropriate I2C address. Or you can directly specify the actual I2C address 0-127.
+	 */
+	SC16IS740I2CTransport(TwoWire &wire, int addr);
+
+	/**
+	 * @brief The size of the Wire receive and transmit buffers (default: 32). See SC16IS740::withI2CBufferSize().
+	 */
+	SC16IS740I2CTransport &withBufferSize(size_t size);
+
+	/**
+	 * @brief Initializes Wire. Called from begin().
+	 */
+	bool begin();
+
+	/**
+	 * @brief Maximum number of bytes readInternal() can read, the Wire buffer size up to the 64 byte FIFO
+	 */
+	inline size_t readInternalMax() const { return (bufferSize < 64) ? bufferSize : 64; };
+
+	/**
+	 * @brief Maximum number of bytes writeInternal() can write. The register address uses one byte of the Wire buffer.
+	 */
+	inline size_t writeInternalMax() const { return (bufferSize - 1 < 64) ? bufferSize - 1 : 64; };
+
+	/**
+	 * @brief Read register reg (0 - 15, before shifting for channel)
+	 */
+	uint8_t readRegister(uint8_t reg, SC16IS740Stats &stats);
+
+	/**
+	 * @brief Write register reg (0 - 15, before shifting for channel)
+	 */
+	bool writeRegister(uint8_t reg, uint8_t value, SC16IS740Stats &stats);
+
+	/**
+	 * @brief Read up to readInternalMax() bytes from the RX FIFO in one transaction
+	 */
+	bool readInternal(uint8_t *buffer, size_t size, SC16IS740Stats &stats);
+
+	/**
+	 * @brief Write up to writeInternalMax() bytes to the TX FIFO in one transaction
+	 */
+	bool writeInternal(const uint8_t *buffer, size_t size, SC16IS740Stats &stats);
+
+	/**
+	 * @brief Write several buffers, up to writeInternalMax() bytes in total, to the TX FIFO in one transaction
+	 */
+	bool writeInternalVec(const SC16IS740Base::WriteVec *vec, size_t count, SC16IS740Stats &stats);
+
+protected:
+	TwoWire &wire;
+	uint8_t addr; // This is the actual I2C address
+	size_t bufferSize = 32; //!< Set by withBufferSize()
+};
+
+/**
+ * @brief Register and FIFO access over SPI, used by SC16IS740SPI and SC16IS740T<SC16IS740SPITransport>
+ *
+ * None of the functions are virtual. The caller holds the port lock and passes the port's statistics.
+ * The options are described in SC16IS740SPI.
+ */
+class SC16IS740SPITransport {
+public:
+	/**
+	 * @brief Construct the transport
+	 *
+	 * @param spi The SPI port to use, typically SPI (A pins) or SPI1 (D pins).
+	 *
+	 * @param cs The pin to use for the CS (chip select) or SS (slave select) pin.
+	 */
+	SC16IS740SPITransport(SPIClass &spi, int cs);
+
+#ifdef SYSTEM_VERSION_v151RC1
+	SC16IS740SPITransport(::particle::SpiProxy<HAL_SPI_INTERFACE1> &spiProxy, int cs = A2) :
+		SC16IS740SPITransport(spiProxy.instance(), cs) {};
+
+#if Wiring_SPI1
+	SC16IS740SPITransport(::particle::SpiProxy<HAL_SPI_INTERFACE2> &spiProxy, int cs = A2) :
+		SC16IS740SPITransport(spiProxy.instance(), cs) {};
+#endif
+
+#if Wiring_SPI2
+	SC16IS740SPITransport(::particle::SpiProxy<HAL_SPI_INTERFACE3> &spiProxy, int cs = A2) :
+		SC16IS740SPITransport(spiProxy.instance(), cs) {};
+#endif
+
+#endif
+
+	/**
+	 * @brief Sets the SPI clock speed (default: 4 MHz). See SC16IS740SPI::withSpiClockSpeedMHz().
+	 */
+	inline SC16IS740SPITransport &withSpiClockSpeedMHz(uint8_t value) { spiClockSpeedMHz = value; return *this; };
+
+	/**
+	 * @brief Sets shared bus mode. See SC16IS740SPI::withSharedBus().
+	 */
+	inline SC16IS740SPITransport &withSharedBus(unsigned long delayus) { sharedBus = true; sharedBusDelay = delayus; return *this; };
+
+	/**
+	 * @brief Only reconfigure a shared bus when its settings changed. See SC16IS740SPI::withSharedBusCache().
+	 */
+	inline SC16IS740SPITransport &withSharedBusCache(bool value = true) { sharedBusCache = value; return *this; };
+
+	/**
+	 * @brief Use DMA for FIFO transfers (default: false). See SC16IS740SPI::withDma().
+	 */
+	inline SC16IS740SPITransport &withDma(bool value = true) { useDma = value; return *this; };
+
+	/**
+	 * @brief Notify transports using withSharedBusCache() that the bus settings were changed by other code
+	 */
+	static void sharedBusChanged(SPIClass &spi);
+
+	/**
+	 * @brief Start an asynchronous DMA write to the TX FIFO. See SC16IS740SPI::writeAsync().
+	 */
+	bool writeAsync(const uint8_t *buffer, size_t size, std::function<void()> completion, SC16IS740Stats &stats);
+
+	/**
+	 * @brief Returns true if an asynchronous DMA transfer started by writeAsync() is in progress
+	 */
+	inline bool isDmaBusy() const { return dmaBusy; };
+
+	/**
+	 * @brief Initializes SPI. Called from begin().
+	 */
+	bool begin();
+
+	/**
+	 * @brief SPI has no transaction size limit, so the whole 64 byte FIFO can be read at once
+	 */
+	inline size_t readInternalMax() const { return 64; };
+
+	/**
+	 * @brief SPI has no transaction size limit, so the whole 64 byte FIFO can be written at once
+	 */
+	inline size_t writeInternalMax() const { return 64; };
 
 	/**
-	 * @brief Returns the number of bytes available to read from the serial port
-	 *
-	 * This is a standard Arduino/Wiring method for Stream objects.
+	 * @brief Read register reg (0 - 15, before shifting for channel)
 	 */
-    virtual int available();
+	uint8_t readRegister(uint8_t reg, SC16IS740Stats &stats);
 
 	/**
-	 * @brief Returns the number of bytes available to write into the TX FIFO
+	 * @brief Write register reg (0 - 15, before shifting for channel)
 	 */
-    virtual int availableForWrite();
+	bool writeRegister(uint8_t reg, uint8_t value, SC16IS740Stats &stats);
 
 	/**
-	 * @brief Read a single byte from the serial port
-	 *
-	 * @return a byte value 0 - 255 or -1 if no data is available.
-	 *
-	 * This is a standard Arduino/Wiring method for Stream objects.
+	 * @brief Read up to 64 bytes from the RX FIFO in one transaction
 	 */
-    virtual int read();
+	bool readInternal(uint8_t *buffer, size_t size, SC16IS740Stats &stats);
 
 	/**
-	 * @brief Read a single byte from the serial port, but do not remove it so it can be read again.
-	 *
-	 * @return a byte value 0 - 255 or -1 if no data is available.
-	 *
-	 * This is a standard Arduino/Wiring method for Stream objects.
+	 * @brief Write up to 64 bytes to the TX FIFO in one transaction
 	 */
-    virtual int peek();
+	bool writeInternal(const uint8_t *buffer, size_t size, SC16IS740Stats &stats);
 
 	/**
-	 * @brief Block until all serial data is sent.
-	 *
-	 * This is a standard Arduino/Wiring method for Stream objects.
+	 * @brief Write several buffers, up to 64 bytes in total, to the TX FIFO in one transaction
 	 */
-    virtual void flush();
+	bool writeInternalVec(const SC16IS740Base::WriteVec *vec, size_t count, SC16IS740Stats &stats);
 
+protected:
 	/**
-	 * @brief Write a single byte to the serial port.
-	 *
-	 * @param c The byte to write. Can write binary or text data.
-	 *
-	 * This is a standard Arduino/Wiring method for Stream objects.
+	 * @brief Begins an SPI transaction, setting the CS line LOW.
+	 * Also sets the SPI speed and mode settings if sharedBus == true
 	 */
-    virtual size_t write(uint8_t c);
+	void beginTransaction();
 
 	/**
-	 * @brief Write a multiple bytes to the serial port.
-	 *
-	 * @param buffer The buffer to write. Can write binary or text data.
-	 *
-	 * @param size The number of bytes to write
-	 *
-	 * @return The number of bytes written.
-	 *
-	 * This is faster than writing a single byte at time because up to 32 bytes of data can
-	 * be sent or received in an I2C transaction, greatly reducing overhead.
+	 * @brief Ends an SPI transaction, basically just setting the CS line high.
 	 */
-	virtual size_t write(const uint8_t *buffer, size_t size);
+	void endTransaction();
 
 	/**
-	 * @brief Read a multiple bytes to the serial port.
-	 *
-	 * @param buffer The buffer to read data into. It will not be null terminated.
-	 *
-	 * @param size The maximum number of bytes to read (buffer size)
+	 * @brief Sets the SPI bus speed, mode and byte order
 	 *
-	 * @return The number of bytes actually read or -1 if there are no bytes available to read.
+	 * This is done in begin() normally or in beginTransaction() if sharedBus == true.
 	 *
-	 * This is faster than reading a single byte at time because up to 32 bytes of data can
-	 * be sent or received in an I2C transaction, greatly reducing overhead.
+	 * The issue is that changing the bus speed and settings requires a delay for things to
+	 * sync back up. If the SPI flash is the only thing on that bus, the delay is unnecessary
+	 * because the speed and mode can be set during begin() instead and just left that way.
 	 */
-	virtual int read(uint8_t *buffer, size_t size);
+	void setSpiSettings();
+
+	/**
+	 * @brief DMA completion callback used by writeAsync()
+	 */
+	static void dmaCompletion();
 
 
-    /**
-     * @brief Read a register
-     *
-     * @param reg The register number to read. Note that this should be the register 0 - 16, before shifting for channel.
-     */
-	virtual uint8_t readRegister(uint8_t reg) = 0;
+	SPIClass &spi;
+	int cs;
 
 	/**
-     * @brief Write a register
-     *
-     * @param reg The register number to write. Note that this should be the register 0 - 16, before shifting for channel.
-     *
-     * @param value The value to write
-     */
-	virtual bool writeRegister(uint8_t reg, uint8_t value) = 0;
+	 * @brief The maximum speed to use. Most flash modules can handle 60 MHz without difficulties.
+	 *
+	 * Flash-chip-specific subclasses can override this if they need a slower speed.
+	 */
+	uint8_t spiClockSpeedMHz = 4;
 
+	bool sharedBus = false;
+	bool sharedBusCache = false;
+	unsigned long sharedBusDelay = 200; // microseconds
 
-	static const uint8_t OPTIONS_8N1 = 0b000011;
-	static const uint8_t OPTIONS_8E1 = 0b011011;
-	static const uint8_t OPTIONS_8O1 = 0b001011;
+	bool useDma = false;
+	volatile bool dmaBusy = false;
+	std::function<void()> dmaCompletionCallback;
+	uint8_t dmaTxBuf[65]; // Register address byte + 64 byte FIFO
+	uint8_t dmaRxBuf[65];
 
-	static const uint8_t OPTIONS_8N2 = 0b000111;
-	static const uint8_t OPTIONS_8E2 = 0b011111;
-	static const uint8_t OPTIONS_8O2 = 0b001111;
+	static SC16IS740SPITransport * volatile dmaAsyncInstance;
+};
 
-	static const uint8_t OPTIONS_7N1 = 0b000010;
-	static const uint8_t OPTIONS_7E1 = 0b011010;
-	static const uint8_t OPTIONS_7O1 = 0b001010;
+/**
+ * @brief A port whose transport is chosen at compile time
+ *
+ * @param Transport SC16IS740I2CTransport or SC16IS740SPITransport
+ *
+ * SC16IS740 and SC16IS740SPI reach the bus through virtual functions so they can be subclassed. Here
+ * those functions are final, and serviceRx(), serviceTx(), and write(buffer, size) are instantiated
+ * for this class, so every register and FIFO access on those paths is a direct call to the transport
+ * and the transfer limits come from the transport instead of a cached value. The constructor arguments
+ * are passed to the transport. Transport options are set using getTransport() before begin():
+ *
+ * ```
+ * SC16IS740T<SC16IS740SPITransport> extSerial(SPI, A2);
+ *
+ * extSerial.withInterruptPin(D2);
+ * extSerial.getTransport().withSpiClockSpeedMHz(8);
+ * ```
+ *
+ * It's an SC16IS740Base, so it works with SC16IS740Buffered and SC16IS740Scheduler. writeAsync() is only
+ * available on SC16IS740SPI.
+ */
+template<class Transport>
+class SC16IS740T : public SC16IS740Base {
+public:
+	template<typename... Args>
+	SC16IS740T(Args&&... args) : transport(std::forward<Args>(args)...) {};
 
-	static const uint8_t OPTIONS_7N2 = 0b000110;
-	static const uint8_t OPTIONS_7E2 = 0b011110;
-	static const uint8_t OPTIONS_7O2 = 0b001110;
+	virtual ~SC16IS740T() {};
 
-	static const uint8_t RHR_THR_REG = 0x00;
-	static const uint8_t IEF_REG = 0x01;
-	static const uint8_t FCR_IIR_REG = 0x02;
-	static const uint8_t LCR_REG = 0x03;
-	static const uint8_t MCR_REG = 0x04;
-	static const uint8_t LSR_REG = 0x05;
-	static const uint8_t MSR_REG = 0x06;
-	static const uint8_t SPR_REG = 0x07;
-	static const uint8_t TXLVL_REG = 0x08;
-	static const uint8_t RXLVL_REG = 0x09;
-	static const uint8_t IODIR_REG = 0x0a;
-	static const uint8_t IOSTATE_REG = 0x0b;
-	static const uint8_t IOINTENA_REG = 0x0c;
-	static const uint8_t IOCONTROL_REG = 0x0e;
-	static const uint8_t EFCR_REG = 0x0f;
+	/**
+	 * @brief Returns the transport, to set its options
+	 */
+	inline Transport &getTransport() { return transport; };
 
-	// Special register block
-	static const uint8_t LCR_SPECIAL_START = 0x80;
-	static const uint8_t LCR_SPECIAL_END = 0xbf;
-	static const uint8_t DLL_REG = 0x00;
-	static const uint8_t DLH_REG = 0x01;
+	virtual uint8_t readRegister(uint8_t reg) final {
+		std::lock_guard<SC16IS740Base> guard(*this);
+		return transport.readRegister(reg, stats);
+	};
 
-	// Enhanced register set
-	static const uint8_t EFR_REG = 0x02;
-	static const uint8_t XON1_REG = 0x04;
-	static const uint8_t XON2_REG = 0x05;
-	static const uint8_t XOFF1_REG = 0x06;
-	static const uint8_t XOFF2_REG = 0x07;
+	virtual bool writeRegister(uint8_t reg, uint8_t value) final {
+		std::lock_guard<SC16IS740Base> guard(*this);
+		return transport.writeRegister(reg, value, stats);
+	};
 
+	using SC16IS740Base::write;
+
+	virtual size_t write(const uint8_t *buffer, size_t size) final { return writeImpl<SC16IS740T>(buffer, size); };
 
 protected:
-	/**
-	 * @brief Called from begin to allow things like wire.begin()
-	 */
-	virtual bool preBegin() { return true; };
+	friend class SC16IS740Base;
 
-	/**
-	 * @brief Maximum number of bytes that can be read by readInternal
-	 */
-	virtual size_t readInternalMax() const = 0;
+	virtual bool preBegin() final { return transport.begin(); };
 
-	/**
-	 * @brief Internal function to read data
-	 *
-	 * It can only read 32 bytes at a time, the maximum that will fit in a 32 byte I2C transaction with
-	 * the register address in the first byte.
-	 */
-	virtual bool readInternal(uint8_t *buffer, size_t size) = 0;
+	virtual size_t readInternalMax() const final { return transport.readInternalMax(); };
 
-	/**
-	 * @brief Maximum number of bytes that can be written by writeInternal
-	 */
-	virtual size_t writeInternalMax() const = 0;
+	virtual bool readInternal(uint8_t *buffer, size_t size) final {
+		std::lock_guard<SC16IS740Base> guard(*this);
+		return transport.readInternal(buffer, size, stats);
+	};
 
-	/**
-	 * @brief Internal function to write data
-	 *
-	 * It can only write 31 bytes at a time, the maximum that will fit in a 32 byte I2C transaction with
-	 * the register address in the first byte.
-	 */
-	virtual bool writeInternal(const uint8_t *buffer, size_t size) = 0;
+	virtual size_t writeInternalMax() const final { return transport.writeInternalMax(); };
 
+	virtual bool writeInternal(const uint8_t *buffer, size_t size) final {
+		std::lock_guard<SC16IS740Base> guard(*this);
+		return transport.writeInternal(buffer, size, stats);
+	};
 
+	virtual bool writeInternalVec(const WriteVec *vec, size_t count) final {
+		std::lock_guard<SC16IS740Base> guard(*this);
+		return transport.writeInternalVec(vec, count, stats);
+	};
 
+	virtual void serviceRx() final { serviceRxImpl<SC16IS740T>(); };
 
+	virtual void serviceTx() final { serviceTxImpl<SC16IS740T>(); };
 
-	int oscillatorHz = 1843200;
-	bool hasPeek = false;
-	uint8_t peekByte = 0;
-	bool writeBlocksWhenFull = true;
+	// Hide the cached values in SC16IS740Base so the *Impl() functions use the transport's limits
+	inline size_t readLimit() const { return transport.readInternalMax(); };
+	inline size_t writeLimit() const { return transport.writeInternalMax(); };
+
+	Transport transport;
 };
 
 class SC16IS740 : public SC16IS740Base {
@@ -248,6 +1754,20 @@ public:
 	 */
 	SC16IS740(TwoWire &wire, int addr);
 
+	/**
+	 * @brief Use I2C transactions larger than the default 32 byte Wire buffer
+	 *
+	 * @param size The size of the Wire receive and transmit buffers. Use 65 or larger to move the full
+	 * 64 byte FIFO in one transaction in each direction.
+	 *
+	 * The default Wire buffer is 32 bytes, which limits reads to 32 bytes and writes to 31 (the register
+	 * address uses one byte). If your application enlarges the Wire buffers by defining acquireWireBuffer()
+	 * (Device OS 1.5.0 and later), pass the buffer size here so draining a full RX FIFO takes one transaction
+	 * instead of two. Don't set this larger than the actual buffers or transfers will fail. Call this
+	 * before begin().
+	 */
+	SC16IS740 &withI2CBufferSize(size_t size);
+
 	/**
 	 * @brief Destructor. You typically don't delete one of these as it's normally a global variable.
 	 */
@@ -277,32 +1797,39 @@ protected:
 
 	/**
 	 * @brief Maximum number of bytes that can be read by readInternal
+	 *
+	 * 32 with the default Wire buffer or up to 64 with withI2CBufferSize().
 	 */
-	inline size_t readInternalMax() const { return 32; };
+	virtual size_t readInternalMax() const;
 
 	/**
 	 * @brief Internal function to read data
 	 *
-	 * It can only read 32 bytes at a time, the maximum that will fit in a 32 byte I2C transaction with
-	 * the register address in the first byte.
+	 * It can only read readInternalMax() bytes at a time.
 	 */
 	virtual bool readInternal(uint8_t *buffer, size_t size);
 
 	/**
 	 * @brief Maximum number of bytes that can be written by writeInternal
+	 *
+	 * 31 with the default Wire buffer (the register address uses the first byte) or up to 64 with
+	 * withI2CBufferSize().
 	 */
-	inline size_t writeInternalMax() const { return 31; };
+	virtual size_t writeInternalMax() const;
 
 	/**
 	 * @brief Internal function to write data
 	 *
-	 * It can only write 31 bytes at a time, the maximum that will fit in a 32 byte I2C transaction with
-	 * the register address in the first byte.
+	 * It can only write writeInternalMax() bytes at a time.
 	 */
 	virtual bool writeInternal(const uint8_t *buffer, size_t size);
 
-	TwoWire &wire;
-	uint8_t addr; // This is the actual I2C address
+	/**
+	 * @brief Internal function to write several buffers to the TX FIFO in a single transaction without copying
+	 */
+	virtual bool writeInternalVec(const WriteVec *vec, size_t count);
+
+	SC16IS740I2CTransport transport;
 
 };
 
@@ -316,7 +1843,7 @@ public:
 	 * @param cs The pin to use for the CS (chip select) or SS (slave select) pin. Often the
 	 * pin A2 is used for SPI and D5 for SPI1, but any free GPIO pin can be used.
 	 *
-	 * @param intPin The pin to use for interrupts from the SC16IS740. Not currently used.
+	 * @param intPin The pin to use for interrupts from the SC16IS740. See withInterruptPin().
 	 * If not using interrupts, omit this parameter or pass -1.
 	 */
 	SC16IS740SPI(SPIClass &spi, int cs, int intPin = -1);
@@ -325,16 +1852,16 @@ public:
 	// In 1.5.0-rc.1, SPI interfaces are handled differently. You can still pass in SPI, SPI1, etc.
 	// but the code to handle it varies
 	SC16IS740SPI(::particle::SpiProxy<HAL_SPI_INTERFACE1> &spiProxy, int cs = A2, int intPin = -1) : 
-		spi(spiProxy.instance()), cs(cs), intPin(intPin) {};
+		SC16IS740SPI(spiProxy.instance(), cs, intPin) {};
 
 #if Wiring_SPI1
 	SC16IS740SPI(::particle::SpiProxy<HAL_SPI_INTERFACE2> &spiProxy, int cs = A2, int intPin = -1) : 
-		spi(spiProxy.instance()), cs(cs), intPin(intPin) {};
+		SC16IS740SPI(spiProxy.instance(), cs, intPin) {};
 #endif
 
 #if Wiring_SPI2
 	SC16IS740SPI(::particle::SpiProxy<HAL_SPI_INTERFACE3> &spiProxy, int cs = A2, int intPin = -1) : 
-		spi(spiProxy.instance()), cs(cs), intPin(intPin) {};
+		SC16IS740SPI(spiProxy.instance(), cs, intPin) {};
 #endif
 
 #endif
@@ -363,7 +1890,7 @@ public:
 	/**
 	 * @brief Sets the SPI clock speed (default: 4 MHz)
 	 */
-	inline SC16IS740SPI &withSpiClockSpeedMHz(uint8_t value) { spiClockSpeedMHz = value; return *this; };
+	inline SC16IS740SPI &withSpiClockSpeedMHz(uint8_t value) { transport.withSpiClockSpeedMHz(value); return *this; };
 
 	/**
 	 * @brief Sets shared bus mode
@@ -375,7 +1902,61 @@ public:
 	 *
 	 * @param delayus Amount of time in microseconds to delay after changing SPI settings to allow the bus to settle.
 	 */
-	inline SC16IS740SPI &withSharedBus(unsigned long delayus) { sharedBus = true; sharedBusDelay = delayus; return *this;};
+	inline SC16IS740SPI &withSharedBus(unsigned long delayus) { transport.withSharedBus(delayus); return *this;};
+
+	/**
+	 * @brief Only reconfigure a shared bus when its settings changed (default: false)
+	 *
+	 * Use with withSharedBus(). The last settings applied to each SPIClass by an SC16IS740SPI object are
+	 * remembered, and the settings (and delay) are only applied again when they differ, so back-to-back
+	 * accesses to SC16IS740 chips on the same bus don't pay the delay. This library can't see changes made
+	 * by other code, so only enable this if every other user of the bus calls sharedBusChanged() after
+	 * changing its settings. Otherwise the SC16IS740 could be accessed with the wrong mode or speed.
+	 */
+	inline SC16IS740SPI &withSharedBusCache(bool value = true) { transport.withSharedBusCache(value); return *this; };
+
+	/**
+	 * @brief Notify SC16IS740SPI objects using withSharedBusCache() that the bus settings were changed by other code
+	 *
+	 * @param spi The SPI bus that was reconfigured
+	 *
+	 * The next transaction on this bus will apply the SPI settings and wait for the shared bus delay.
+	 */
+	static void sharedBusChanged(SPIClass &spi);
+
+	/**
+	 * @brief Use DMA for FIFO transfers (default: false)
+	 *
+	 * When enabled, readInternal() and writeInternal() move the register address and up to 64 bytes
+	 * of data in a single DMA transaction instead of one spi.transfer() call per byte. Register
+	 * reads and writes are only 2 bytes and still use single-byte transfers.
+	 */
+	inline SC16IS740SPI &withDma(bool value = true) { transport.withDma(value); return *this; };
+
+	/**
+	 * @brief Write data into the TX FIFO using DMA without waiting for the transfer to complete
+	 *
+	 * @param buffer The data to write. It is copied, so the buffer can be reused when this returns.
+	 *
+	 * @param size Number of bytes, up to 64. You must make sure there is room in the TX FIFO
+	 * first, for example by checking availableForWrite().
+	 *
+	 * @param completion Optional function to call when the transfer completes. This is called
+	 * from an interrupt context, so it must not access the bus, allocate memory, or block.
+	 *
+	 * @return true if the transfer was started, false if size is too large or another
+	 * asynchronous transfer is in progress.
+	 *
+	 * Only one asynchronous transfer can be in progress at a time across all SC16IS740SPI
+	 * objects. Other accesses to this object, and to any other SC16IS740SPI object on the same
+	 * SPI bus, wait for the transfer to complete.
+	 */
+	bool writeAsync(const uint8_t *buffer, size_t size, std::function<void()> completion = 0);
+
+	/**
+	 * @brief Returns true if an asynchronous DMA transfer started by writeAsync() is in progress
+	 */
+	inline bool isDmaBusy() const { return transport.isDmaBusy(); };
 
 protected:
 	/**
@@ -385,69 +1966,183 @@ protected:
 
 	/**
 	 * @brief Maximum number of bytes that can be read by readInternal
+	 *
+	 * SPI has no transaction size limit, so the whole 64 byte FIFO can be read at once.
 	 */
-	inline size_t readInternalMax() const { return 64; };
+	virtual size_t readInternalMax() const { return transport.readInternalMax(); };
 
 	/**
 	 * @brief Internal function to read data
 	 *
-	 * It can only read 32 bytes at a time, the maximum that will fit in a 32 byte I2C transaction with
-	 * the register address in the first byte.
+	 * The whole 64 byte FIFO can be read in one transaction.
 	 */
 	virtual bool readInternal(uint8_t *buffer, size_t size);
 
 	/**
 	 * @brief Maximum number of bytes that can be written by writeInternal
+	 *
+	 * SPI has no transaction size limit, so the whole 64 byte FIFO can be written at once.
 	 */
-	inline size_t writeInternalMax() const { return 64; };
+	virtual size_t writeInternalMax() const { return transport.writeInternalMax(); };
 
 	/**
 	 * @brief Internal function to write data
 	 *
-	 * It can only write 31 bytes at a time, the maximum that will fit in a 32 byte I2C transaction with
-	 * the register address in the first byte.
+	 * The whole 64 byte FIFO can be written in one transaction.
 	 */
 	virtual bool writeInternal(const uint8_t *buffer, size_t size);
 
 	/**
-	 * @brief Begins an SPI transaction, setting the CS line LOW.
-	 * Also sets the SPI speed and mode settings if sharedBus == true
+	 * @brief Internal function to write several buffers to the TX FIFO in a single transaction without copying
 	 */
-	void beginTransaction();
+	virtual bool writeInternalVec(const WriteVec *vec, size_t count);
+
+	SC16IS740SPITransport transport;
+
+};
+
+
+
+/**
+ * @brief An SC16IS740 or SC16IS740SPI port with receive and transmit buffers sized at compile time
+ *
+ * @param Port SC16IS740, SC16IS740SPI, or SC16IS740T
+ *
+ * @param RX_SIZE Number of bytes the receive buffer holds. 0 uses the default 64 byte read-ahead buffer.
+ *
+ * @param TX_SIZE Number of bytes the transmit queue holds. 0 for no transmit queue.
+ *
+ * The buffers are members of the object so there is no heap allocation, and the constructor
+ * arguments are the same as Port. This is the same as calling withRxBuffer() and withTxBuffer()
+ * with your own storage. For example:
+ *
+ * ```
+ * SC16IS740Buffered<SC16IS740, 512, 256> extSerial(Wire, 0);
+ * ```
+ */
+template<class Port, size_t RX_SIZE, size_t TX_SIZE>
+class SC16IS740Buffered : public Port {
+public:
+	template<typename... Args>
+	SC16IS740Buffered(Args&&... args) : Port(std::forward<Args>(args)...) {
+		if (RX_SIZE > 0) {
+			this->withRxBuffer(rxStorage, sizeof(rxStorage));
+		}
+		if (TX_SIZE > 0) {
+			this->withTxBuffer(txStorage, sizeof(txStorage));
+		}
+	};
+
+protected:
+	uint8_t rxStorage[RX_SIZE + 1];
+	uint8_t txStorage[TX_SIZE + 1];
+};
+
+/**
+ * @brief Services multiple SC16IS740 and SC16IS740SPI ports from a single loop() call
+ *
+ * Ports added to a scheduler are serviced round-robin. Instead of reading RXLVL and TXLVL on every
+ * port, each port is checked using its IRQ pin if it has one or a single IIR read if not, and bus
+ * time is only spent moving data for ports that have work. Received data goes into each port's
+ * receive buffer (see withRxBuffer()) and transmitted data comes from its transmit queue (see
+ * withTxBuffer()). available(), read(), and buffered write() on a managed port do not access the bus.
+ *
+ * Call loop() from the application loop(), or use startThread() to service the ports from a worker
+ * thread so application load doesn't affect how quickly the FIFOs are emptied.
+ */
+class SC16IS740Scheduler {
+public:
+	SC16IS740Scheduler();
+	virtual ~SC16IS740Scheduler();
 
 	/**
-	 * @brief Ends an SPI transaction, basically just setting the CS line high.
+	 * @brief Add a port to be serviced by this scheduler. You must do this before calling begin() on the port.
+	 *
+	 * @param port The SC16IS740 or SC16IS740SPI object
+	 *
+	 * @param priority The maximum number of service passes this port gets in each round of loop(),
+	 * if it still has work (default: 1). Use a higher value for ports with higher baud rates.
+	 *
+	 * @return false if MAX_PORTS ports have already been added
 	 */
-	void endTransaction();
+	bool addPort(SC16IS740Base &port, uint8_t priority = 1);
 
 	/**
-	 * @brief Sets the SPI bus speed, mode and byte order
+	 * @brief Service all ports. Call this from loop() if startThread() is not used.
+	 */
+	void loop();
+
+	/**
+	 * @brief Service all ports from a worker thread instead of loop()
 	 *
-	 * This is done in begin() normally or in beginTransaction() if sharedBus == true.
+	 * @param priority The thread priority. The default is one above the application thread so
+	 * slow code in loop() can't delay servicing the FIFOs.
 	 *
-	 * The issue is that changing the bus speed and settings requires a delay for things to
-	 * sync back up. If the SPI flash is the only thing on that bus, the delay is unnecessary
-	 * because the speed and mode can be set during begin() instead and just left that way.
+	 * @param stackSize The thread stack size in bytes. The onReceive() and onTxEmpty() callbacks
+	 * run on this stack.
+	 *
+	 * @param idleMs How long the thread sleeps after a pass where no port moved data (default: 1).
+	 * Without an interrupt pin each idle pass costs one IIR read per port. The thread only sleeps
+	 * when nothing moved, so a port whose receive buffer is full can't keep it spinning.
+	 *
+	 * @return false if the thread has already been started or could not be created
+	 *
+	 * Use one scheduler per TwoWire or SPIClass, and add every port on that bus to it, because the
+	 * scheduler's lock is what keeps transactions from the worker and the application thread apart.
+	 * Add the ports and call begin() on them before starting the thread. The application thread
+	 * then only touches each port's receive and transmit buffers for read() and buffered write(),
+	 * which are lock-free. Calls that do access the bus, such as flush() and setBaud(), take the lock.
 	 */
-	void setSpiSettings();
+	bool startThread(os_thread_prio_t priority = OS_THREAD_PRIORITY_DEFAULT + 1, size_t stackSize = 2048, unsigned long idleMs = 1);
 
+	/**
+	 * @brief Take the bus lock. Held by the worker thread during each service pass.
+	 */
+	inline void lock() { mutex.lock(); };
 
-	SPIClass &spi;
-	int cs;
-	int intPin;
+	/**
+	 * @brief Release the bus lock
+	 */
+	inline void unlock() { mutex.unlock(); };
 
 	/**
-	 * @brief The maximum speed to use. Most flash modules can handle 60 MHz without difficulties.
-	 *
-	 * Flash-chip-specific subclasses can override this if they need a slower speed.
+	 * @brief Returns true if startThread() has been called successfully
 	 */
-	uint8_t spiClockSpeedMHz = 4;
+	inline bool isThreadRunning() const { return threadRunning.load(); };
 
-	bool sharedBus = false;
-	unsigned long sharedBusDelay = 200; // microseconds
+	/**
+	 * @brief Returns true if called from the worker thread, including from port callbacks
+	 */
+	inline bool isWorkerThread() const { os_thread_t worker = workerThread.load(); return worker != 0 && os_thread_current(NULL) == worker; };
 
-};
+	static const size_t MAX_PORTS = 8;
 
+protected:
+	/**
+	 * @brief Does one round of service on all ports
+	 *
+	 * @return true if any port moved data
+	 */
+	bool service();
 
+	/**
+	 * @brief Worker thread started by startThread()
+	 */
+	static void threadFunction(void *param);
+
+	struct PortEntry {
+		SC16IS740Base *port;
+		uint8_t priority;
+	};
+
+	PortEntry ports[MAX_PORTS];
+	size_t numPorts = 0;
+	size_t nextPort = 0;
+	RecursiveMutex mutex;
+	Thread *thread = 0;
+	std::atomic<bool> threadRunning{false}; // Read by ports on both threads
+	std::atomic<os_thread_t> workerThread{0}; // Set by threadFunction()
+	unsigned long idleMs = 1;
+};
 
 #endif /* __SC16IS740RK_H */
@@ -0,0 +1,397 @@
+#include "SC16IS740Sim.h"
+
+#include <algorithm>
+
+// Register numbers, before shifting for the bus
+static const uint8_t RHR_THR = 0x00;
+static const uint8_t IER = 0x01;
+static const uint8_t IIR_FCR = 0x02;
+static const uint8_t LCR = 0x03;
+static const uint8_t MCR = 0x04;
+static const uint8_t LSR = 0x05;
+static const uint8_t MSR_TCR = 0x06;
+static const uint8_t SPR_TLR = 0x07;
+static const uint8_t TXLVL = 0x08;
+static const uint8_t RXLVL = 0x09;
+static const uint8_t EFCR = 0x0f;
+
+static const size_t FIFO_SIZE = 64;
+
+std::vector<SC16IS740Sim *> &SC16IS740Sim::chips() {
+	static std::vector<SC16IS740Sim *> list;
+	return list;
+}
+
+SC16IS740Sim::SC16IS740Sim(uint32_t oscillatorHz) : oscillatorHz(oscillatorHz) {
+	now = simMicros();
+	chips().push_back(this);
+}
+
+SC16IS740Sim::~SC16IS740Sim() {
+	std::vector<SC16IS740Sim *> &list = chips();
+	list.erase(std::remove(list.begin(), list.end(), this), list.end());
+}
+
+SC16IS740Sim &SC16IS740Sim::withI2C(TwoWire &wire, uint8_t addr) {
+	this->wire = &wire;
+	i2cAddr = addr;
+	return *this;
+}
+
+SC16IS740Sim &SC16IS740Sim::withSPI(SPIClass &spi, pin_t csPin) {
+	this->spi = &spi;
+	this->csPin = csPin;
+	return *this;
+}
+
+SC16IS740Sim &SC16IS740Sim::withIrqPin(pin_t pin) {
+	irqPin = pin;
+	irqLevel = irqAsserted();
+	return *this;
+}
+
+void SC16IS740Sim::receive(const uint8_t *data, size_t size) {
+	receiveAfter(0, data, size);
+}
+
+void SC16IS740Sim::receiveAfter(unsigned long idleMicros, const uint8_t *data, size_t size) {
+	uint64_t t = std::max(now, rxLineEnd) + idleMicros;
+	for(size_t ii = 0; ii < size; ii++) {
+		t += charMicros();
+		rxLine.push_back(LineByte{t, data[ii]});
+	}
+	rxLineEnd = t;
+}
+
+uint8_t SC16IS740Sim::busRead(uint8_t reg) {
+	uint8_t value = 0;
+
+	counters.registerReads++;
+
+	if ((lcr & 0x80) != 0 && reg <= 1) {
+		value = (reg == 0) ? dll : dlh;
+	}
+	else if (lcr == 0xbf && reg >= 2 && reg != LCR) {
+		switch(reg) {
+		case 2: value = efr; break;
+		case 4: value = xon1; break;
+		case 5: value = xon2; break;
+		case 6: value = xoff1; break;
+		case 7: value = xoff2; break;
+		}
+	}
+	else {
+		switch(reg) {
+		case RHR_THR:
+			counters.rhrReads++;
+			if (rxFifo.empty()) {
+				counters.emptyReads++;
+			}
+			else {
+				value = rxFifo.front();
+				rxFifo.pop_front();
+			}
+			rxActivity = now;
+			break;
+
+		case IER:
+			value = ier;
+			break;
+
+		case IIR_FCR:
+			value = (fcr & 0x01) ? 0xc0 : 0x00;
+			if ((ier & 0x01) && rxTimeout()) {
+				value |= 0x0c;
+			}
+			else if ((ier & 0x01) && rxFifo.size() >= rxTriggerLevel()) {
+				value |= 0x04;
+			}
+			else if ((ier & 0x02) && FIFO_SIZE - txFifo.size() >= txTriggerSpaces()) {
+				value |= 0x02;
+			}
+			else {
+				value |= 0x01;
+			}
+			break;
+
+		case LCR:
+			value = lcr;
+			break;
+
+		case MCR:
+			value = mcr;
+			break;
+
+		case LSR:
+			if (!rxFifo.empty()) {
+				value |= 0x01;
+			}
+			if (lsrOverrun) {
+				value |= 0x02;
+				lsrOverrun = false;
+			}
+			if (txFifo.empty()) {
+				value |= 0x20;
+				if (!txShifting) {
+					value |= 0x40;
+				}
+			}
+			break;
+
+		case MSR_TCR:
+			value = ((mcr & 0x04) && (efr & 0x10)) ? tcr : 0;
+			break;
+
+		case SPR_TLR:
+			value = ((mcr & 0x04) && (efr & 0x10)) ? tlr : spr;
+			break;
+
+		case TXLVL:
+			value = (uint8_t) (FIFO_SIZE - txFifo.size());
+			break;
+
+		case RXLVL:
+			value = (uint8_t) rxFifo.size();
+			break;
+
+		case EFCR:
+			value = efcr;
+			break;
+		}
+	}
+
+	updateIrq();
+	return value;
+}
+
+void SC16IS740Sim::busWrite(uint8_t reg, uint8_t value) {
+	counters.registerWrites++;
+
+	bool enhanced = (efr & 0x10) != 0;
+
+	if ((lcr & 0x80) != 0 && reg <= 1) {
+		if (reg == 0) {
+			dll = value;
+		}
+		else {
+			dlh = value;
+		}
+	}
+	else if (lcr == 0xbf && reg >= 2 && reg != LCR) {
+		switch(reg) {
+		case 2: efr = value; break;
+		case 4: xon1 = value; break;
+		case 5: xon2 = value; break;
+		case 6: xoff1 = value; break;
+		case 7: xoff2 = value; break;
+		}
+	}
+	else {
+		switch(reg) {
+		case RHR_THR:
+			counters.thrWrites++;
+			if (txFifo.size() >= FIFO_SIZE) {
+				counters.txOverruns++;
+			}
+			else {
+				txFifo.push_back(value);
+				if (!txShifting) {
+					loadShiftRegister();
+				}
+			}
+			break;
+
+		case IER:
+			// IER[7:4] can only be modified when EFR[4] is set
+			ier = enhanced ? value : ((ier & 0xf0) | (value & 0x0f));
+			break;
+
+		case IIR_FCR:
+			if (value & 0x02) {
+				rxFifo.clear();
+			}
+			if (value & 0x04) {
+				txFifo.clear();
+			}
+			// FCR[5:4] can only be modified when EFR[4] is set. The reset bits are self-clearing.
+			fcr = (value & 0xc9) | (enhanced ? (value & 0x30) : (fcr & 0x30));
+			break;
+
+		case LCR:
+			lcr = value;
+			break;
+
+		case MCR:
+			// MCR[7:5] can only be modified when EFR[4] is set
+			mcr = enhanced ? value : ((mcr & 0xe0) | (value & 0x1f));
+			break;
+
+		case MSR_TCR:
+			if ((mcr & 0x04) && enhanced) {
+				tcr = value;
+			}
+			break;
+
+		case SPR_TLR:
+			if ((mcr & 0x04) && enhanced) {
+				tlr = value;
+			}
+			else {
+				spr = value;
+			}
+			break;
+
+		case EFCR:
+			efcr = value;
+			break;
+		}
+	}
+
+	updateIrq();
+}
+
+uint64_t SC16IS740Sim::nextEvent(int &event) const {
+	uint64_t next = UINT64_MAX;
+	event = -1;
+
+	if (txShifting && txShiftDone < next) {
+		next = txShiftDone;
+		event = 0;
+	}
+	if (!rxLine.empty() && rxLine.front().time < next) {
+		next = rxLine.front().time;
+		event = 1;
+	}
+	if (!rxFifo.empty()) {
+		uint64_t timeoutAt = rxActivity + 4 * (uint64_t) charMicros();
+		if (timeoutAt > now && timeoutAt < next) {
+			next = timeoutAt;
+			event = 2;
+		}
+	}
+	return next;
+}
+
+uint64_t SC16IS740Sim::nextEventTime() const {
+	int event;
+	return nextEvent(event);
+}
+
+void SC16IS740Sim::advanceTo(uint64_t t) {
+	while(true) {
+		int event;
+		uint64_t next = nextEvent(event);
+		if (event < 0 || next > t) {
+			break;
+		}
+
+		now = next;
+		if (event == 0) {
+			txShifting = false;
+			if (loopback()) {
+				rxArrive(txShiftByte);
+			}
+			else {
+				sent.push_back(txShiftByte);
+			}
+			loadShiftRegister();
+		}
+		else if (event == 1) {
+			uint8_t c = rxLine.front().c;
+			rxLine.pop_front();
+			if (!loopback()) {
+				// The RX pin is disconnected in loopback mode
+				rxArrive(c);
+			}
+		}
+		updateIrq();
+	}
+
+	if (t > now) {
+		now = t;
+	}
+	updateIrq();
+}
+
+bool SC16IS740Sim::irqAsserted() const {
+	if ((ier & 0x01) && (rxFifo.size() >= rxTriggerLevel() || rxTimeout())) {
+		return true;
+	}
+	if ((ier & 0x02) && FIFO_SIZE - txFifo.size() >= txTriggerSpaces()) {
+		return true;
+	}
+	return false;
+}
+
+uint32_t SC16IS740Sim::baud() const {
+	uint32_t divisor = dll | (dlh << 8);
+	if (divisor == 0) {
+		return 0;
+	}
+	uint32_t prescaler = (mcr & 0x80) ? 4 : 1;
+	return oscillatorHz / (16 * prescaler * divisor);
+}
+
+uint32_t SC16IS740Sim::charMicros() const {
+	uint64_t divisor = dll | (dlh << 8);
+	if (divisor == 0) {
+		return 1000000;
+	}
+	uint64_t prescaler = (mcr & 0x80) ? 4 : 1;
+
+	// Start bit + 5 to 8 data bits + optional parity + 1 or 2 stop bits
+	uint64_t bits = 1 + 5 + (lcr & 0x03) + ((lcr & 0x08) ? 1 : 0) + ((lcr & 0x04) ? 2 : 1);
+
+	return (uint32_t) ((bits * 1000000 * 16 * prescaler * divisor + oscillatorHz / 2) / oscillatorHz);
+}
+
+size_t SC16IS740Sim::rxTriggerLevel() const {
+	static const size_t levels[4] = { 8, 16, 56, 60 };
+	if (tlr & 0xf0) {
+		return (tlr >> 4) * 4;
+	}
+	return levels[fcr >> 6];
+}
+
+size_t SC16IS740Sim::txTriggerSpaces() const {
+	static const size_t levels[4] = { 8, 16, 32, 56 };
+	if (tlr & 0x0f) {
+		return (tlr & 0x0f) * 4;
+	}
+	return levels[(fcr >> 4) & 0x03];
+}
+
+bool SC16IS740Sim::rxTimeout() const {
+	return !rxFifo.empty() && now >= rxActivity + 4 * (uint64_t) charMicros();
+}
+
+void SC16IS740Sim::loadShiftRegister() {
+	if (txFifo.empty() || baud() == 0) {
+		return;
+	}
+	txShiftByte = txFifo.front();
+	txFifo.pop_front();
+	txShifting = true;
+	txShiftDone = now + charMicros();
+}
+
+void SC16IS740Sim::rxArrive(uint8_t c) {
+	if (rxFifo.size() >= FIFO_SIZE) {
+		counters.rxOverruns++;
+		lsrOverrun = true;
+	}
+	else {
+		rxFifo.push_back(c);
+	}
+	rxActivity = now;
+}
+
+void SC16IS740Sim::updateIrq() {
+	bool level = irqAsserted();
+	if (level && !irqLevel && irqPin >= 0) {
+		irqLevel = level;
+		extern void simFallingEdge(pin_t pin);
+		simFallingEdge(irqPin);
+	}
+	irqLevel = level;
+}
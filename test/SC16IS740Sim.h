@@ -0,0 +1,192 @@
+#ifndef __SC16IS740SIM_H
+#define __SC16IS740SIM_H
+
+#include "Particle.h"
+
+#include <deque>
+#include <vector>
+
+/**
+ * @brief Register-level model of one SC16IS740 for host tests
+ *
+ * Models the general, special (LCR[7] = 1), and enhanced (LCR = 0xBF) register sets, the 64 byte
+ * RX and TX FIFOs, RXLVL/TXLVL, FCR resets and trigger levels, TCR/TLR, IIR and the IRQ output,
+ * LSR, MCR loopback and the divide-by-4 prescaler, and a baud rate timing model: transmitted bytes
+ * leave the TX shift register one character time apart, and bytes given to receive() arrive one
+ * character time apart. Hardware flow control and GPIOs are not modeled.
+ *
+ * Attach it to the fake Wire (by I2C address) or SPI (by CS pin). Simulated time is advanced by
+ * delay(), micros(), and bus transactions, which take as long as they would on the wire.
+ */
+class SC16IS740Sim {
+public:
+	/**
+	 * @brief Create a chip. It's added to the set of chips stepped by simulated time.
+	 */
+	SC16IS740Sim(uint32_t oscillatorHz = 1843200);
+	virtual ~SC16IS740Sim();
+
+	/**
+	 * @brief Respond to I2C transactions at addr (7-bit address, such as 0x4d for A0 = A1 = VDD)
+	 */
+	SC16IS740Sim &withI2C(TwoWire &wire, uint8_t addr);
+
+	/**
+	 * @brief Respond to SPI transfers while csPin is low
+	 */
+	SC16IS740Sim &withSPI(SPIClass &spi, pin_t csPin);
+
+	/**
+	 * @brief Drive the IRQ output on this GPIO. Interrupt handlers attached to it are called on the falling edge.
+	 */
+	SC16IS740Sim &withIrqPin(pin_t pin);
+
+	/**
+	 * @brief Bytes arrive on the RX pin, back-to-back after anything already in flight
+	 */
+	void receive(const uint8_t *data, size_t size);
+	void receive(const char *str) { receive((const uint8_t *)str, strlen(str)); };
+
+	/**
+	 * @brief Bytes arrive on the RX pin starting after the line has been idle for idleMicros
+	 */
+	void receiveAfter(unsigned long idleMicros, const uint8_t *data, size_t size);
+
+	/**
+	 * @brief Number of bytes scheduled by receive() that have not arrived yet
+	 */
+	size_t receivePending() const { return rxLine.size(); };
+
+	/**
+	 * @brief Bytes that have left the TX pin, in order
+	 */
+	std::vector<uint8_t> sent;
+
+	/**
+	 * @brief Register access as seen from the bus, used by the fake TwoWire and SPIClass
+	 */
+	uint8_t busRead(uint8_t reg);
+	void busWrite(uint8_t reg, uint8_t value);
+
+	/**
+	 * @brief Step the model to simulated time now (microseconds)
+	 */
+	void advanceTo(uint64_t now);
+
+	/**
+	 * @brief Time of the next TX, RX, or RX time-out event, or UINT64_MAX if there is none
+	 */
+	uint64_t nextEventTime() const;
+
+	/**
+	 * @brief True if IRQ is asserted (the pin is low)
+	 */
+	bool irqAsserted() const;
+
+	/**
+	 * @brief Current baud rate from the divisor and prescaler, or 0 if the divisor is not set
+	 */
+	uint32_t baud() const;
+
+	/**
+	 * @brief One character time in microseconds at the current baud rate and format
+	 */
+	uint32_t charMicros() const;
+
+	size_t rxLevel() const { return rxFifo.size(); };
+	size_t txLevel() const { return txFifo.size(); };
+	bool loopback() const { return (mcr & 0x10) != 0; };
+
+	/**
+	 * @brief Bus activity seen by this chip
+	 */
+	struct Counters {
+		uint32_t transactions = 0; //!< I2C transactions or SPI CS low periods addressed to this chip
+		uint32_t registerReads = 0; //!< Bytes read from any register, including RHR
+		uint32_t registerWrites = 0; //!< Bytes written to any register, including THR
+		uint32_t rhrReads = 0; //!< Bytes read from RHR
+		uint32_t thrWrites = 0; //!< Bytes written to THR
+		uint32_t rxOverruns = 0; //!< Bytes lost because the RX FIFO was full
+		uint32_t txOverruns = 0; //!< Bytes lost because THR was written with the TX FIFO full
+		uint32_t emptyReads = 0; //!< Reads of RHR with the RX FIFO empty
+		uint64_t busNanos = 0; //!< Time the bus spent on transactions addressed to this chip
+	} counters;
+
+	// Register shadows, readable by tests
+	uint8_t ier = 0;
+	uint8_t fcr = 0;
+	uint8_t lcr = 0x1d; // Reset value
+	uint8_t mcr = 0;
+	uint8_t spr = 0xff;
+	uint8_t dll = 0;
+	uint8_t dlh = 0;
+	uint8_t efr = 0;
+	uint8_t xon1 = 0, xon2 = 0, xoff1 = 0, xoff2 = 0;
+	uint8_t tcr = 0;
+	uint8_t tlr = 0;
+	uint8_t efcr = 0;
+
+	// Used by the fake buses
+	TwoWire *wire = 0;
+	uint8_t i2cAddr = 0;
+	uint8_t i2cRegister = 0; // Register selected by the last write-only transaction
+	SPIClass *spi = 0;
+	int csPin = -1;
+	int irqPin = -1;
+	bool irqLevel = false;
+
+	static std::vector<SC16IS740Sim *> &chips();
+
+protected:
+	uint64_t nextEvent(int &event) const;
+	size_t rxTriggerLevel() const;
+	size_t txTriggerSpaces() const;
+	bool rxTimeout() const;
+	void loadShiftRegister();
+	void rxArrive(uint8_t c);
+	void updateIrq();
+
+	uint32_t oscillatorHz;
+	uint64_t now = 0;
+
+	std::deque<uint8_t> rxFifo;
+	std::deque<uint8_t> txFifo;
+	bool lsrOverrun = false;
+	uint64_t rxActivity = 0; // Last RX arrival or RHR read, for the RX time-out
+
+	bool txShifting = false;
+	uint8_t txShiftByte = 0;
+	uint64_t txShiftDone = 0;
+
+	struct LineByte {
+		uint64_t time;
+		uint8_t c;
+	};
+	std::deque<LineByte> rxLine;
+	uint64_t rxLineEnd = 0;
+};
+
+/**
+ * @brief Simulated time in microseconds
+ */
+uint64_t simMicros();
+
+/**
+ * @brief Advance simulated time, stepping every chip
+ */
+void simAdvance(uint64_t us);
+
+/**
+ * @brief Reset simulated time, pins, and interrupt handlers between tests
+ */
+void simReset();
+
+/**
+ * @brief Stop every Thread started since the last call and wait for them to exit
+ *
+ * The next time a stopping thread advances simulated time, it unwinds out of its thread function.
+ * Also called by simReset().
+ */
+void simStopThreads();
+
+#endif /* __SC16IS740SIM_H */
@@ -0,0 +1,384 @@
+#include "Particle.h"
+#include "SC16IS740Sim.h"
+
+#include <atomic>
+#include <map>
+#include <thread>
+#include <vector>
+
+TwoWire Wire;
+SPIClass SPI;
+
+static uint64_t simTime = 0;
+static uint64_t simNanos = 0; // Sub-microsecond remainder from SPI byte times
+
+static int pinLevels[256];
+static std::map<pin_t, std::function<void(void)> > interruptHandlers;
+
+// Per-chip SPI frame state
+struct SpiFrame {
+	size_t index;
+	uint8_t reg;
+	bool read;
+};
+static std::map<SC16IS740Sim *, SpiFrame> spiFrames;
+
+// Threads started by Thread, and the flag that makes them unwind. Thrown from simAdvance() so a thread
+// stops even if it's stuck in a polling loop.
+struct SimThreadStop {};
+static std::vector<std::thread> simThreads;
+static std::atomic<bool> simThreadsStopping(false);
+static thread_local bool simThreadWorker = false;
+
+uint64_t simMicros() {
+	return simTime;
+}
+
+// True while chips are being stepped, so micros() called from an interrupt handler returns the
+// time of the event that caused the interrupt instead of advancing time again
+static bool stepping = false;
+
+void simAdvance(uint64_t us) {
+	if (stepping) {
+		return;
+	}
+	if (simThreadWorker && simThreadsStopping.load()) {
+		throw SimThreadStop();
+	}
+	stepping = true;
+
+	// Step from event to event so interrupt handlers see the time the IRQ was asserted
+	uint64_t target = simTime + us;
+	while(true) {
+		uint64_t next = target;
+		for(SC16IS740Sim *chip : SC16IS740Sim::chips()) {
+			uint64_t t = chip->nextEventTime();
+			if (t < next) {
+				next = t;
+			}
+		}
+		if (next > simTime) {
+			simTime = next;
+		}
+		for(SC16IS740Sim *chip : SC16IS740Sim::chips()) {
+			chip->advanceTo(simTime);
+		}
+		if (simTime >= target) {
+			break;
+		}
+	}
+
+	stepping = false;
+}
+
+static void simAdvanceNanos(uint64_t ns) {
+	simNanos += ns;
+	if (simNanos >= 1000) {
+		uint64_t us = simNanos / 1000;
+		simNanos -= us * 1000;
+		simAdvance(us);
+	}
+}
+
+void simStopThreads() {
+	simThreadsStopping = true;
+	for(std::thread &thread : simThreads) {
+		thread.join();
+	}
+	simThreads.clear();
+	simThreadsStopping = false;
+}
+
+void simReset() {
+	simStopThreads();
+	simTime = 0;
+	simNanos = 0;
+	for(size_t ii = 0; ii < sizeof(pinLevels) / sizeof(pinLevels[0]); ii++) {
+		pinLevels[ii] = HIGH;
+	}
+	interruptHandlers.clear();
+	spiFrames.clear();
+
+	Wire.end();
+	Wire.bufferSize = 32;
+	Wire.speed = CLOCK_SPEED_100KHZ;
+
+	SPI.clockHz = 4 * MHZ;
+	SPI.settingsChanges = 0;
+	SPI.selectConflicts = 0;
+	SPI.deferDmaCompletion = false;
+	SPI.pendingDmaCallback = 0;
+}
+
+void simFallingEdge(pin_t pin) {
+	std::map<pin_t, std::function<void(void)> >::iterator it = interruptHandlers.find(pin);
+	if (it != interruptHandlers.end()) {
+		it->second();
+	}
+}
+
+// Every call to micros() or millis() takes 1 microsecond, so polling loops make progress
+unsigned long millis() {
+	simAdvance(1);
+	return (unsigned long) (simTime / 1000);
+}
+
+unsigned long micros() {
+	simAdvance(1);
+	return (unsigned long) simTime;
+}
+
+void delay(unsigned long ms) {
+	simAdvance((uint64_t) ms * 1000);
+}
+
+void delayMicroseconds(unsigned int us) {
+	simAdvance(us);
+}
+
+void os_thread_yield() {
+	simAdvance(1);
+}
+
+os_thread_t os_thread_current(void *reserved) {
+	// Any address unique to the calling thread will do as a handle
+	static thread_local char handle;
+	return &handle;
+}
+
+Thread::Thread(const char *name, os_thread_fn_t function, void *param, os_thread_prio_t priority, size_t stackSize) {
+	simThreads.push_back(std::thread([function, param]() {
+		simThreadWorker = true;
+		try {
+			function(param);
+		}
+		catch(const SimThreadStop &) {
+		}
+	}));
+}
+
+void pinMode(pin_t pin, int mode) {
+	if (mode == INPUT_PULLUP) {
+		pinLevels[pin] = HIGH;
+	}
+}
+
+static void setPin(pin_t pin, int level) {
+	int old = pinLevels[pin];
+	pinLevels[pin] = level;
+	if (old == level) {
+		return;
+	}
+	for(SC16IS740Sim *chip : SC16IS740Sim::chips()) {
+		if (chip->spi == 0 || chip->csPin != (int) pin) {
+			continue;
+		}
+		if (level == LOW) {
+			spiFrames[chip] = SpiFrame{0, 0, false};
+		}
+		else {
+			std::map<SC16IS740Sim *, SpiFrame>::iterator it = spiFrames.find(chip);
+			if (it != spiFrames.end()) {
+				if (it->second.index > 0) {
+					chip->counters.transactions++;
+				}
+				spiFrames.erase(it);
+			}
+		}
+	}
+}
+
+void digitalWrite(pin_t pin, uint8_t value) {
+	setPin(pin, value ? HIGH : LOW);
+}
+
+void pinSetFast(pin_t pin) {
+	setPin(pin, HIGH);
+}
+
+void pinResetFast(pin_t pin) {
+	setPin(pin, LOW);
+}
+
+int32_t pinReadFast(pin_t pin) {
+	for(SC16IS740Sim *chip : SC16IS740Sim::chips()) {
+		if (chip->irqPin == (int) pin) {
+			return chip->irqAsserted() ? LOW : HIGH;
+		}
+	}
+	return pinLevels[pin];
+}
+
+int32_t digitalRead(pin_t pin) {
+	return pinReadFast(pin);
+}
+
+bool attachInterrupt(uint16_t pin, std::function<void(void)> fn, InterruptMode mode, int8_t priority, uint8_t subpriority) {
+	interruptHandlers[pin] = fn;
+	return true;
+}
+
+void detachInterrupt(uint16_t pin) {
+	interruptHandlers.erase(pin);
+}
+
+size_t Print::write(const uint8_t *buffer, size_t size) {
+	size_t n = 0;
+	while(size--) {
+		if (write(*buffer++)) {
+			n++;
+		}
+		else {
+			break;
+		}
+	}
+	return n;
+}
+
+static SC16IS740Sim *findI2C(TwoWire *wire, uint8_t addr) {
+	for(SC16IS740Sim *chip : SC16IS740Sim::chips()) {
+		if (chip->wire == wire && chip->i2cAddr == addr) {
+			return chip;
+		}
+	}
+	return 0;
+}
+
+// Start, address byte, data bytes with an ACK bit each, and stop
+static uint64_t i2cNanos(uint32_t speed, size_t bytes) {
+	return ((uint64_t) (bytes + 1) * 9 + 2) * 1000000000 / speed;
+}
+
+void TwoWire::beginTransmission(uint8_t addr) {
+	txAddr = addr;
+	txLen = 0;
+}
+
+size_t TwoWire::write(uint8_t c) {
+	if (txLen >= bufferSize) {
+		return 0;
+	}
+	txBuf[txLen++] = c;
+	return 1;
+}
+
+size_t TwoWire::write(const uint8_t *buffer, size_t size) {
+	return Print::write(buffer, size);
+}
+
+uint8_t TwoWire::endTransmission(uint8_t stop) {
+	if (!enabled) {
+		return 4;
+	}
+	uint64_t ns = i2cNanos(speed, txLen);
+	simAdvance(ns / 1000);
+
+	SC16IS740Sim *chip = findI2C(this, txAddr);
+	if (!chip) {
+		return 2;
+	}
+	chip->counters.transactions++;
+	chip->counters.busNanos += ns;
+
+	if (txLen > 0) {
+		// Register address byte: bits 6:3 are the register, bits 2:1 the channel (always 0)
+		uint8_t reg = (txBuf[0] >> 3) & 0x0f;
+		chip->i2cRegister = reg;
+		for(size_t ii = 1; ii < txLen; ii++) {
+			chip->busWrite(reg, txBuf[ii]);
+		}
+	}
+	return 0;
+}
+
+uint8_t TwoWire::requestFrom(uint8_t addr, uint8_t quantity, uint8_t stop) {
+	rxLen = rxIndex = 0;
+	if (!enabled) {
+		return 0;
+	}
+	if (quantity > bufferSize) {
+		quantity = (uint8_t) bufferSize;
+	}
+	uint64_t ns = i2cNanos(speed, quantity);
+	simAdvance(ns / 1000);
+
+	SC16IS740Sim *chip = findI2C(this, addr);
+	if (!chip) {
+		return 0;
+	}
+	chip->counters.transactions++;
+	chip->counters.busNanos += ns;
+
+	for(size_t ii = 0; ii < quantity; ii++) {
+		rxBuf[ii] = chip->busRead(chip->i2cRegister);
+	}
+	rxLen = quantity;
+	return quantity;
+}
+
+uint8_t SPIClass::transfer(uint8_t data) {
+	uint64_t ns = (uint64_t) 8 * 1000000000 / clockHz;
+	simAdvanceNanos(ns);
+
+	size_t selected = 0;
+	for(SC16IS740Sim *chip : SC16IS740Sim::chips()) {
+		if (chip->spi == this && spiFrames.count(chip)) {
+			selected++;
+		}
+	}
+	if (selected > 1) {
+		selectConflicts++;
+	}
+
+	for(SC16IS740Sim *chip : SC16IS740Sim::chips()) {
+		if (chip->spi != this) {
+			continue;
+		}
+		std::map<SC16IS740Sim *, SpiFrame>::iterator it = spiFrames.find(chip);
+		if (it == spiFrames.end()) {
+			continue;
+		}
+		SpiFrame &frame = it->second;
+		uint8_t result = 0xff;
+		chip->counters.busNanos += ns;
+		if (frame.index == 0) {
+			// Register address byte: bit 7 is read, bits 6:3 are the register
+			frame.read = (data & 0x80) != 0;
+			frame.reg = (data >> 3) & 0x0f;
+		}
+		else if (frame.read) {
+			result = chip->busRead(frame.reg);
+		}
+		else {
+			chip->busWrite(frame.reg, data);
+		}
+		frame.index++;
+		return result;
+	}
+	return 0xff;
+}
+
+void SPIClass::transfer(const void *txBuffer, void *rxBuffer, size_t length, wiring_spi_dma_transfercomplete_callback_t callback) {
+	const uint8_t *tx = (const uint8_t *) txBuffer;
+	uint8_t *rx = (uint8_t *) rxBuffer;
+	for(size_t ii = 0; ii < length; ii++) {
+		uint8_t result = transfer(tx ? tx[ii] : 0xff);
+		if (rx) {
+			rx[ii] = result;
+		}
+	}
+	if (deferDmaCompletion) {
+		pendingDmaCallback = callback;
+	}
+	else if (callback) {
+		callback();
+	}
+}
+
+void SPIClass::completeDma() {
+	wiring_spi_dma_transfercomplete_callback_t callback = pendingDmaCallback;
+	pendingDmaCallback = 0;
+	if (callback) {
+		callback();
+	}
+}
@@ -0,0 +1,190 @@
+#ifndef __PARTICLE_H_HOST_SHIM
+#define __PARTICLE_H_HOST_SHIM
+
+// Host stand-in for the parts of the Particle Device OS API used by SC16IS740RK, so the library
+// compiles unmodified on Linux. Time is simulated: delay() and bus transactions advance the clock,
+// and every SC16IS740Sim attached to the fake buses is stepped along with it. See SC16IS740Sim.h.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <functional>
+#include <mutex>
+
+typedef uint32_t system_tick_t;
+typedef uint16_t pin_t;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+
+#define A0 10
+#define A1 11
+#define A2 12
+#define D2 2
+#define D3 3
+
+typedef enum {
+	CHANGE,
+	RISING,
+	FALLING
+} InterruptMode;
+
+// Time
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+// GPIO
+void pinMode(pin_t pin, int mode);
+void digitalWrite(pin_t pin, uint8_t value);
+int32_t digitalRead(pin_t pin);
+void pinSetFast(pin_t pin);
+void pinResetFast(pin_t pin);
+int32_t pinReadFast(pin_t pin);
+
+bool attachInterrupt(uint16_t pin, std::function<void(void)> fn, InterruptMode mode, int8_t priority = -1, uint8_t subpriority = 0);
+
+template<typename T>
+bool attachInterrupt(uint16_t pin, void (T::*handler)(), T *instance, InterruptMode mode, int8_t priority = -1, uint8_t subpriority = 0) {
+	return attachInterrupt(pin, std::bind(handler, instance), mode, priority, subpriority);
+}
+
+void detachInterrupt(uint16_t pin);
+
+// Threads. A Thread runs its function on a std::thread. Simulated time and the chip models are not
+// thread-safe, so once a test starts one it leaves the simulation to that thread until simStopThreads().
+typedef uint8_t os_thread_prio_t;
+typedef void (*os_thread_fn_t)(void *param);
+typedef void *os_thread_t;
+
+#define OS_THREAD_PRIORITY_DEFAULT 2
+#define OS_THREAD_STACK_SIZE_DEFAULT 3072
+
+void os_thread_yield();
+os_thread_t os_thread_current(void *reserved);
+
+class Thread {
+public:
+	Thread(const char *name, os_thread_fn_t function, void *param = NULL, os_thread_prio_t priority = OS_THREAD_PRIORITY_DEFAULT, size_t stackSize = OS_THREAD_STACK_SIZE_DEFAULT);
+};
+
+class RecursiveMutex : public std::recursive_mutex {
+};
+
+// Logging is discarded
+class Logger {
+public:
+	Logger(const char *name) {};
+	void trace(const char *fmt, ...) const {};
+	void info(const char *fmt, ...) const {};
+	void warn(const char *fmt, ...) const {};
+	void error(const char *fmt, ...) const {};
+};
+
+// Print and Stream, reduced to what SC16IS740Base overrides or calls
+class Print {
+public:
+	virtual ~Print() {};
+	virtual size_t write(uint8_t c) = 0;
+	virtual size_t write(const uint8_t *buffer, size_t size);
+	size_t write(const char *str) { return write((const uint8_t *)str, strlen(str)); };
+};
+
+class Stream : public Print {
+public:
+	virtual int available() = 0;
+	virtual int read() = 0;
+	virtual int peek() = 0;
+	virtual void flush() = 0;
+
+	void setTimeout(system_tick_t timeout) { _timeout = timeout; };
+
+protected:
+	system_tick_t _timeout = 1000;
+};
+
+// I2C. Routes transactions to the SC16IS740Sim at the addressed slave.
+#define CLOCK_SPEED_100KHZ 100000
+#define CLOCK_SPEED_400KHZ 400000
+
+class TwoWire : public Stream {
+public:
+	void begin() { enabled = true; };
+	void end() { enabled = false; };
+	void setSpeed(uint32_t speed) { if (!enabled) { this->speed = speed; } };
+	bool isEnabled() const { return enabled; };
+
+	void beginTransmission(uint8_t addr);
+	uint8_t endTransmission(uint8_t stop = true);
+	uint8_t requestFrom(uint8_t addr, uint8_t quantity, uint8_t stop = true);
+
+	virtual size_t write(uint8_t c);
+	virtual size_t write(const uint8_t *buffer, size_t size);
+	virtual int available() { return (int) (rxLen - rxIndex); };
+	virtual int read() { return (rxIndex < rxLen) ? rxBuf[rxIndex++] : -1; };
+	virtual int peek() { return (rxIndex < rxLen) ? rxBuf[rxIndex] : -1; };
+	virtual void flush() {};
+
+	/**
+	 * @brief Size of the receive and transmit buffers, as with acquireWireBuffer() (default: 32)
+	 */
+	size_t bufferSize = 32;
+	uint32_t speed = CLOCK_SPEED_100KHZ;
+
+protected:
+	bool enabled = false;
+	uint8_t txAddr = 0;
+	uint8_t txBuf[256];
+	size_t txLen = 0;
+	uint8_t rxBuf[256];
+	size_t rxLen = 0;
+	size_t rxIndex = 0;
+};
+
+extern TwoWire Wire;
+
+// SPI. Bytes are routed to the SC16IS740Sim whose CS pin is low.
+#define MSBFIRST 1
+#define LSBFIRST 0
+#define SPI_MODE0 0
+#define MHZ 1000000
+
+typedef void (*wiring_spi_dma_transfercomplete_callback_t)(void);
+
+class SPIClass {
+public:
+	void begin(uint16_t ssPin) {};
+	void setBitOrder(uint8_t order) { bitOrder = order; settingsChanges++; };
+	void setClockSpeed(unsigned value, unsigned scale) { clockHz = value * scale; settingsChanges++; };
+	void setDataMode(uint8_t mode) { dataMode = mode; settingsChanges++; };
+
+	uint8_t transfer(uint8_t data);
+
+	/**
+	 * @brief DMA transfer. The data moves before returning. The completion callback is called
+	 * before returning too, unless deferDmaCompletion is set; then completeDma() calls it.
+	 */
+	void transfer(const void *txBuffer, void *rxBuffer, size_t length, wiring_spi_dma_transfercomplete_callback_t callback);
+
+	/**
+	 * @brief Call the completion callback of a DMA transfer deferred by deferDmaCompletion
+	 */
+	void completeDma();
+
+	uint32_t clockHz = 4 * MHZ;
+	uint8_t bitOrder = MSBFIRST;
+	uint8_t dataMode = SPI_MODE0;
+	uint32_t settingsChanges = 0;
+	uint32_t selectConflicts = 0; // Bytes transferred while more than one chip's CS was low
+	bool deferDmaCompletion = false;
+	wiring_spi_dma_transfercomplete_callback_t pendingDmaCallback = 0;
+};
+
+extern SPIClass SPI;
+
+#endif /* __PARTICLE_H_HOST_SHIM */
@@ -0,0 +1,1031 @@
+// Host tests for SC16IS740RK against the SC16IS740Sim register model.
+//
+// Build and run with "make test" in this directory. Each test starts from simReset(), so simulated
+// time starts at 0 and there are no pins or interrupt handlers left over from earlier tests.
+
+#include "SC16IS740RK.h"
+#include "SC16IS740Sim.h"
+
+#include <algorithm>
+#include <atomic>
+
+#include <stdio.h>
+#include <chrono>
+#include <string>
+#include <thread>
+
+static int testsRun = 0;
+static int testsFailed = 0;
+static bool currentFailed = false;
+
+#define EXPECT(cond) \
+	do { \
+		if (!(cond)) { \
+			printf("  %s:%d: expected %s\n", __FILE__, __LINE__, #cond); \
+			currentFailed = true; \
+		} \
+	} while(0)
+
+#define EXPECT_EQ(a, b) \
+	do { \
+		long long _a = (long long) (a), _b = (long long) (b); \
+		if (_a != _b) { \
+			printf("  %s:%d: expected %s == %s (%lld != %lld)\n", __FILE__, __LINE__, #a, #b, _a, _b); \
+			currentFailed = true; \
+		} \
+	} while(0)
+
+typedef void (*TestFn)();
+
+static void runTest(const char *name, TestFn fn) {
+	simReset();
+	currentFailed = false;
+	fn();
+	testsRun++;
+	if (currentFailed) {
+		testsFailed++;
+	}
+	printf("%s %s\n", currentFailed ? "FAIL" : "ok  ", name);
+}
+
+static std::string sentString(const SC16IS740Sim &chip) {
+	return std::string(chip.sent.begin(), chip.sent.end());
+}
+
+static const uint8_t I2C_ADDR = 0x4d; // SC16IS740(Wire, 0)
+
+static void testBeginProgramsChip() {
+	SC16IS740Sim chip;
+	chip.withI2C(Wire, I2C_ADDR);
+	SC16IS740 port(Wire, 0);
+
+	EXPECT(port.begin(9600));
+	EXPECT_EQ(chip.dll, 12);
+	EXPECT_EQ(chip.dlh, 0);
+	EXPECT_EQ(chip.lcr, SC16IS740Base::OPTIONS_8N1);
+	EXPECT(chip.fcr & 0x01);
+	EXPECT_EQ(chip.baud(), 9600);
+	EXPECT_EQ(port.getActualBaud(), 9600);
+	EXPECT_EQ(chip.ier, 0);
+}
+
+static void testSetBaudWritesOnlyChanges() {
+	SC16IS740Sim chip;
+	chip.withI2C(Wire, I2C_ADDR);
+	SC16IS740 port(Wire, 0);
+	port.begin(9600);
+
+	chip.counters = SC16IS740Sim::Counters();
+	EXPECT(port.setBaud(19200));
+	EXPECT_EQ(chip.baud(), 19200);
+	// LCR with DLL selected, DLL, LCR restored. DLH and MCR are unchanged.
+	EXPECT_EQ(chip.counters.registerWrites, 3);
+
+	chip.counters = SC16IS740Sim::Counters();
+	EXPECT(port.setBaud(19200));
+	EXPECT_EQ(chip.counters.registerWrites, 0);
+
+	EXPECT(port.setFormat(SC16IS740Base::OPTIONS_8E1));
+	EXPECT_EQ(chip.lcr, SC16IS740Base::OPTIONS_8E1);
+	EXPECT_EQ(chip.counters.registerWrites, 1);
+}
+
+static void testWriteAndFlush() {
+	SC16IS740Sim chip;
+	chip.withI2C(Wire, I2C_ADDR);
+	SC16IS740 port(Wire, 0);
+	port.begin(9600);
+
+	std::string msg(100, 'x');
+	for(size_t ii = 0; ii < msg.size(); ii++) {
+		msg[ii] = 'a' + (ii % 26);
+	}
+
+	uint64_t start = simMicros();
+	EXPECT_EQ(port.write((const uint8_t *)msg.data(), msg.size()), msg.size());
+	uint64_t writeElapsed = simMicros() - start;
+	uint32_t blocked = port.getStats().writeBlockedMicros;
+	EXPECT(port.flush(1000));
+	uint64_t elapsed = simMicros() - start;
+
+	EXPECT(sentString(chip) == msg);
+	EXPECT_EQ(chip.counters.txOverruns, 0);
+
+	// Can't finish before the last stop bit, and shouldn't take much longer
+	EXPECT(elapsed >= msg.size() * chip.charMicros());
+	EXPECT(elapsed < msg.size() * chip.charMicros() + 5000);
+
+	// The write blocked in 31 byte chunks until the last chunk fit in the FIFO. The time is measured,
+	// so it's never more than the write took, and flush() isn't counted.
+	EXPECT(blocked >= (msg.size() - 64 - 31) * chip.charMicros());
+	EXPECT(blocked <= writeElapsed);
+	EXPECT_EQ(port.getStats().writeBlockedMicros, blocked);
+}
+
+static void testBulkRead() {
+	SC16IS740Sim chip;
+	chip.withI2C(Wire, I2C_ADDR);
+	SC16IS740 port(Wire, 0);
+	port.begin(115200);
+
+	std::string msg = "The quick brown fox jumps over the lazy dog";
+	chip.receive(msg.c_str());
+	delay(10);
+	EXPECT_EQ(chip.rxLevel(), msg.size());
+
+	std::string got;
+	uint8_t buf[64];
+	int n;
+	while((n = port.read(buf, sizeof(buf))) > 0) {
+		got.append((const char *)buf, n);
+	}
+	EXPECT(got == msg);
+	EXPECT_EQ(chip.counters.emptyReads, 0);
+
+	// RXLVL, then the FIFO in 32 and 11 byte transactions
+	SC16IS740Stats stats = port.getStats();
+	EXPECT_EQ(stats.bulkReads, 2);
+	EXPECT_EQ(stats.bytesIn, msg.size());
+	EXPECT_EQ(stats.rxFifoHighWater, msg.size());
+}
+
+// A transport that overrides the transfer limits, as a third-party transport would
+class SmallTransferPort : public SC16IS740 {
+public:
+	SmallTransferPort() : SC16IS740(Wire, 0) {}
+
+protected:
+	virtual size_t readInternalMax() const { return 8; }
+	virtual size_t writeInternalMax() const { return 4; }
+};
+
+static void testTransferLimitOverride() {
+	SC16IS740Sim chip;
+	chip.withI2C(Wire, I2C_ADDR);
+	SmallTransferPort port;
+	port.begin(115200);
+
+	std::string msg = "The quick brown fox jumps over the lazy dog";
+	chip.receive(msg.c_str());
+	delay(10);
+
+	std::string got;
+	uint8_t buf[64];
+	int n;
+	while((n = port.read(buf, sizeof(buf))) > 0) {
+		got.append((const char *)buf, n);
+	}
+	EXPECT(got == msg);
+
+	// 43 bytes in 8 byte transactions
+	EXPECT_EQ(port.getStats().bulkReads, 6);
+
+	// 10 bytes in 4 byte transactions
+	unsigned long before = chip.counters.transactions;
+	EXPECT_EQ(port.write((const uint8_t *)"0123456789", 10), 10);
+	EXPECT(chip.counters.transactions - before >= 3);
+	port.flush();
+	EXPECT(sentString(chip) == "0123456789");
+}
+
+static void testReadBytesTimeout() {
+	SC16IS740Sim chip;
+	chip.withI2C(Wire, I2C_ADDR);
+	SC16IS740 port(Wire, 0);
+	port.begin(9600);
+	port.setTimeout(50);
+
+	chip.receive("abc");
+
+	char buf[16];
+	uint64_t start = simMicros();
+	EXPECT_EQ(port.readBytes(buf, sizeof(buf)), 3);
+	uint64_t elapsed = simMicros() - start;
+	EXPECT(memcmp(buf, "abc", 3) == 0);
+
+	// The timeout runs from the last byte received, which is read after one 16 character wait
+	EXPECT(elapsed >= 50000);
+	EXPECT(elapsed < 17 * chip.charMicros() + 50000 + 2000);
+
+	// With nothing arriving, the 16 character poll interval is cut short at the timeout. The timeout
+	// is counted in millis(), so it can end up to 1 ms early.
+	port.setTimeout(10);
+	start = simMicros();
+	EXPECT_EQ(port.readBytes(buf, sizeof(buf)), 0);
+	elapsed = simMicros() - start;
+	EXPECT(elapsed >= 9000);
+	EXPECT(elapsed < 12000);
+
+	start = simMicros();
+	EXPECT_EQ(port.read(), -1);
+	EXPECT_EQ(port.parseInt(), 0);
+	elapsed = simMicros() - start;
+	EXPECT(elapsed >= 9000);
+	EXPECT(elapsed < 12000);
+}
+
+static void testReadBytesKeepsUp() {
+	// SPI can read the whole FIFO at once, but polling only after 64 characters would overrun it
+	SC16IS740Sim chip;
+	chip.withSPI(SPI, A2);
+	SC16IS740SPI port(SPI, A2);
+	port.begin(57600);
+
+	uint8_t data[256];
+	for(size_t ii = 0; ii < sizeof(data); ii++) {
+		data[ii] = (uint8_t) ii;
+	}
+	chip.receive(data, sizeof(data));
+
+	uint8_t buf[sizeof(data)];
+	EXPECT_EQ(port.readBytes((char *)buf, sizeof(buf)), sizeof(buf));
+	EXPECT(memcmp(buf, data, sizeof(data)) == 0);
+	EXPECT_EQ(chip.counters.rxOverruns, 0);
+
+	// One RXLVL read and one FIFO read per poll, not a poll per byte after the first data arrives
+	SC16IS740Stats stats = port.getStats();
+	EXPECT(stats.bulkReads <= 8);
+	EXPECT(stats.registerReads <= 8);
+}
+
+static void testRS485WithFlowControl() {
+	// RTS drives the transceiver, so auto-RTS stays off whichever option is set first
+	for(int order = 0; order < 2; order++) {
+		simReset();
+		SC16IS740Sim chip;
+		chip.withI2C(Wire, I2C_ADDR);
+		SC16IS740 port(Wire, 0);
+		if (order == 0) {
+			port.withRS485().withHardwareFlowControl();
+		}
+		else {
+			port.withHardwareFlowControl().withRS485();
+		}
+		port.begin(9600);
+
+		EXPECT_EQ(chip.efr & 0xc0, 0x80); // Auto-CTS only
+		EXPECT_EQ(chip.efcr & 0x30, 0x30); // RTS control, high while transmitting
+	}
+}
+
+static void testTxQueue() {
+	SC16IS740Sim chip;
+	chip.withI2C(Wire, I2C_ADDR);
+	SC16IS740 port(Wire, 0);
+	static uint8_t txBuf[256];
+	port.withTxBuffer(txBuf, sizeof(txBuf));
+	port.begin(9600);
+
+	uint8_t data[200];
+	for(size_t ii = 0; ii < sizeof(data); ii++) {
+		data[ii] = (uint8_t) ii;
+	}
+
+	// Fits in the queue, so this returns without waiting for the line
+	uint64_t start = simMicros();
+	EXPECT_EQ(port.write(data, sizeof(data)), sizeof(data));
+	EXPECT(simMicros() - start < 20 * chip.charMicros());
+	EXPECT(chip.sent.size() < sizeof(data));
+
+	for(int ii = 0; ii < 1000 && chip.sent.size() < sizeof(data); ii++) {
+		port.loop();
+		delay(1);
+	}
+	EXPECT_EQ(chip.sent.size(), sizeof(data));
+	EXPECT(memcmp(chip.sent.data(), data, sizeof(data)) == 0);
+	EXPECT_EQ(chip.counters.txOverruns, 0);
+	EXPECT_EQ(port.getStats().txBufferHighWater, sizeof(data));
+}
+
+static void testWritev() {
+	SC16IS740Sim chip;
+	chip.withI2C(Wire, I2C_ADDR);
+	SC16IS740 port(Wire, 0);
+	port.begin(115200);
+
+	SC16IS740Base::WriteVec vec[3] = {
+		{ (const uint8_t *)"header:", 7 },
+		{ (const uint8_t *)"payload", 7 },
+		{ (const uint8_t *)"\r\n", 2 },
+	};
+	EXPECT_EQ(port.writev(vec, 3), 16);
+	EXPECT(port.flush(1000));
+	EXPECT(sentString(chip) == "header:payload\r\n");
+
+	// All three pieces in one transaction
+	EXPECT_EQ(port.getStats().bulkWrites, 1);
+}
+
+static void testWritevShortWriteStops() {
+	SC16IS740Sim chip;
+	chip.withI2C(Wire, I2C_ADDR);
+	SC16IS740 port(Wire, 0);
+	static uint8_t txBuf[64];
+	port.withTxBuffer(txBuf, sizeof(txBuf));
+	port.blockOnOverrun(false);
+	port.begin(9600);
+
+	// Fill the TX FIFO so the queue can't move
+	uint8_t fill[63];
+	memset(fill, '-', sizeof(fill));
+	EXPECT_EQ(port.write(fill, sizeof(fill)), sizeof(fill));
+	port.loop();
+
+	std::string a(100, 'a');
+	std::string b(10, 'B');
+	SC16IS740Base::WriteVec vec[2] = {
+		{ (const uint8_t *)a.data(), a.size() },
+		{ (const uint8_t *)b.data(), b.size() },
+	};
+	size_t written = port.writev(vec, 2);
+
+	// Only a prefix of the first vector fits. Nothing from the second may follow it.
+	EXPECT(written < a.size());
+	EXPECT(port.flush(5000));
+	std::string sent = sentString(chip);
+	EXPECT_EQ(sent.size(), sizeof(fill) + written);
+	EXPECT(sent.find('B') == std::string::npos);
+}
+
+static void testSchedulerWithInterruptPin() {
+	SC16IS740Sim chip;
+	chip.withI2C(Wire, I2C_ADDR).withIrqPin(A1);
+	SC16IS740 port(Wire, 0);
+	port.withInterruptPin(A1);
+
+	SC16IS740Scheduler scheduler;
+	EXPECT(scheduler.addPort(port));
+
+	int receiveCalls = 0;
+	port.onReceive([&receiveCalls](SC16IS740Base &) { receiveCalls++; });
+	EXPECT(port.begin(115200));
+
+	// Nothing to do: the IRQ pin is high, so the bus isn't touched
+	chip.counters = SC16IS740Sim::Counters();
+	for(int ii = 0; ii < 10; ii++) {
+		scheduler.loop();
+	}
+	EXPECT_EQ(chip.counters.transactions, 0);
+
+	chip.receive("hello world");
+	for(int ii = 0; ii < 20; ii++) {
+		scheduler.loop();
+		delay(1);
+	}
+	EXPECT(receiveCalls > 0);
+
+	char buf[32];
+	int n = port.read((uint8_t *)buf, sizeof(buf));
+	EXPECT_EQ(n, 11);
+	EXPECT(n == 11 && memcmp(buf, "hello world", 11) == 0);
+}
+
+// Exposes service() so tests can see whether a pass counted as busy
+class TestScheduler : public SC16IS740Scheduler {
+public:
+	using SC16IS740Scheduler::service;
+};
+
+static void testSchedulerIdlesWhenRxBufferFull() {
+	SC16IS740Sim chip;
+	chip.withI2C(Wire, I2C_ADDR);
+	SC16IS740 port(Wire, 0);
+	static uint8_t rxBuf[9];
+	port.withRxBuffer(rxBuf, sizeof(rxBuf));
+
+	TestScheduler scheduler;
+	scheduler.addPort(port);
+	port.begin(115200);
+
+	chip.receive("0123456789abcdefghij");
+	delay(5);
+
+	EXPECT(scheduler.service());
+	EXPECT_EQ(port.available(), 8);
+
+	// The receive buffer is full and the rest is still in the FIFO. Nothing can move until the
+	// application reads, so the pass must not count as busy or the worker thread would spin.
+	EXPECT(!scheduler.service());
+	EXPECT(!scheduler.service());
+
+	// And it doesn't touch the bus while blocked
+	chip.counters = SC16IS740Sim::Counters();
+	for(int ii = 0; ii < 10; ii++) {
+		scheduler.loop();
+	}
+	EXPECT_EQ(chip.counters.transactions, 0);
+
+	uint8_t buf[32];
+	EXPECT_EQ(port.read(buf, sizeof(buf)), 8);
+	EXPECT(scheduler.service());
+	EXPECT_EQ(port.available(), 8);
+}
+
+static void testManagedBlockingWriteWithoutThread() {
+	SC16IS740Sim chip;
+	chip.withI2C(Wire, I2C_ADDR);
+	SC16IS740 port(Wire, 0);
+	static uint8_t txBuf[64];
+	port.withTxBuffer(txBuf, sizeof(txBuf));
+
+	SC16IS740Scheduler scheduler;
+	scheduler.addPort(port);
+	port.begin(115200);
+
+	uint8_t data[200];
+	for(size_t ii = 0; ii < sizeof(data); ii++) {
+		data[ii] = (uint8_t) (ii * 7);
+	}
+
+	// Larger than the 63 byte queue. With no worker thread, write() has to move it.
+	uint64_t start = simMicros();
+	EXPECT_EQ(port.write(data, sizeof(data)), sizeof(data));
+	EXPECT(simMicros() - start < 1000000);
+
+	for(int ii = 0; ii < 100 && chip.sent.size() < sizeof(data); ii++) {
+		scheduler.loop();
+		delay(1);
+	}
+	EXPECT_EQ(chip.sent.size(), sizeof(data));
+	EXPECT(chip.sent.size() == sizeof(data) && memcmp(chip.sent.data(), data, sizeof(data)) == 0);
+}
+
+static void testManagedFlushWithoutThread() {
+	SC16IS740Sim chip;
+	chip.withI2C(Wire, I2C_ADDR);
+	SC16IS740 port(Wire, 0);
+	static uint8_t txBuf[256];
+	port.withTxBuffer(txBuf, sizeof(txBuf));
+
+	SC16IS740Scheduler scheduler;
+	scheduler.addPort(port);
+	port.begin(115200);
+
+	std::string msg(150, 'F');
+	EXPECT_EQ(port.write((const uint8_t *)msg.data(), msg.size()), msg.size());
+
+	// No worker thread, so flush() has to move the queue itself
+	EXPECT(port.flush(1000));
+	EXPECT(sentString(chip) == msg);
+}
+
+// Callbacks run on the worker thread with the bus lock held. A blocking write() or flush() there has
+// to move the queue itself, as the worker it would otherwise wait for is the caller.
+static void testWorkerThreadCallbacks() {
+	SC16IS740Sim chip;
+	chip.withI2C(Wire, I2C_ADDR);
+	SC16IS740 port(Wire, 0);
+	static uint8_t txBuf[64];
+	port.withTxBuffer(txBuf, sizeof(txBuf));
+
+	SC16IS740Scheduler scheduler;
+	scheduler.addPort(port);
+	EXPECT(port.begin(115200));
+
+	uint8_t data[200];
+	for(size_t ii = 0; ii < sizeof(data); ii++) {
+		data[ii] = (uint8_t) (ii * 3);
+	}
+
+	// Each time the queue empties, queue more than it holds. The last refill also waits for the line.
+	const int numRefills = 3;
+	std::atomic<int> refills(0);
+	std::atomic<bool> flushed(false);
+	std::atomic<size_t> refillWritten(0);
+	port.onTxEmpty([&](SC16IS740Base &p) {
+		if (refills.load() < numRefills) {
+			refillWritten += p.write(data, sizeof(data));
+			if (refills.load() == numRefills - 1) {
+				flushed = p.flush(1000);
+			}
+			refills++;
+		}
+	});
+	EXPECT_EQ(port.write(data, 10), 10);
+
+	// The worker owns the simulation until simStopThreads(), so wait in real time
+	EXPECT(scheduler.startThread());
+	for(int ii = 0; ii < 5000 && !flushed.load(); ii++) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	simStopThreads();
+
+	EXPECT_EQ(refills.load(), numRefills);
+	EXPECT(flushed.load());
+	EXPECT_EQ(refillWritten.load(), numRefills * sizeof(data));
+	EXPECT_EQ(chip.sent.size(), 10 + numRefills * sizeof(data));
+	EXPECT_EQ(chip.counters.txOverruns, 0);
+	bool match = chip.sent.size() == 10 + numRefills * sizeof(data) && memcmp(chip.sent.data(), data, 10) == 0;
+	for(int ii = 0; match && ii < numRefills; ii++) {
+		match = memcmp(&chip.sent[10 + ii * sizeof(data)], data, sizeof(data)) == 0;
+	}
+	EXPECT(match);
+}
+
+static void testLoopback() {
+	SC16IS740Sim chip;
+	chip.withI2C(Wire, I2C_ADDR);
+	SC16IS740 port(Wire, 0);
+	port.begin(9600);
+
+	SC16IS740LoopbackResult result;
+	EXPECT(port.runLoopbackTest(57600, 300, result));
+	EXPECT_EQ(result.bytesVerified, 300);
+	EXPECT_EQ(result.errors, 0);
+	EXPECT(result.minRoundTripMicros >= chip.charMicros());
+
+	// Loopback is off and the baud rate restored, and nothing went out on the TX pin
+	EXPECT(!chip.loopback());
+	EXPECT_EQ(chip.baud(), 9600);
+	EXPECT_EQ(chip.sent.size(), 0);
+}
+
+static void testFrameMode() {
+	SC16IS740Sim chip;
+	chip.withI2C(Wire, I2C_ADDR);
+	SC16IS740 port(Wire, 0);
+	static uint8_t frameBuf[64];
+	port.withFrameMode(frameBuf, sizeof(frameBuf));
+	port.begin(9600);
+
+	const uint8_t frame1[] = { 0x01, 0x03, 0x00, 0x00, 0x00, 0x0a, 0xc5, 0xcd };
+	chip.receive(frame1, sizeof(frame1));
+
+	// Not complete until the line has been idle for 4 character times
+	delay(9);
+	EXPECT(!port.frameAvailable());
+	delay(10);
+	EXPECT(port.frameAvailable());
+
+	uint8_t buf[64];
+	unsigned long timestamp = 0;
+	EXPECT_EQ(port.readFrame(buf, sizeof(buf), &timestamp), sizeof(frame1));
+	EXPECT(memcmp(buf, frame1, sizeof(frame1)) == 0);
+	EXPECT(!port.frameAvailable());
+}
+
+static void testFrameTimestampFromInterrupt() {
+	SC16IS740Sim chip;
+	chip.withI2C(Wire, I2C_ADDR).withIrqPin(A1);
+	SC16IS740 port(Wire, 0);
+	static uint8_t frameBuf[64];
+	port.withFrameMode(frameBuf, sizeof(frameBuf)).withInterruptPin(A1);
+	port.begin(9600);
+
+	const uint8_t frame[] = { 0x11, 0x22, 0x33, 0x44, 0x55 };
+	uint64_t start = simMicros();
+	chip.receive(frame, sizeof(frame));
+	unsigned long lastByteMs = (unsigned long) ((start + sizeof(frame) * chip.charMicros()) / 1000);
+
+	// Serviced long after the frame ended
+	delay(50);
+	EXPECT(port.frameAvailable());
+
+	uint8_t buf[64];
+	unsigned long timestamp = 0;
+	EXPECT_EQ(port.readFrame(buf, sizeof(buf), &timestamp), sizeof(frame));
+	EXPECT((long) (timestamp - lastByteMs) >= -1 && (long) (timestamp - lastByteMs) <= 1);
+}
+
+static void testFrameTimestampAboveTriggerLevel() {
+	// A frame longer than the RX trigger level (16), so IRQ is already low when the time-out occurs
+	uint8_t frame[40];
+	for(size_t ii = 0; ii < sizeof(frame); ii++) {
+		frame[ii] = (uint8_t) ii;
+	}
+
+	// Serviced late, promptly, and with the trigger level interrupt serviced just after the frame ended
+	unsigned long serviceDelayMs[3] = { 120, 0, 44 };
+
+	for(size_t ii = 0; ii < 3; ii++) {
+		simReset();
+		SC16IS740Sim chip;
+		chip.withI2C(Wire, I2C_ADDR).withIrqPin(A1);
+		SC16IS740 port(Wire, 0);
+		static uint8_t frameBuf[64];
+		port.withFrameMode(frameBuf, sizeof(frameBuf)).withInterruptPin(A1);
+		port.begin(9600);
+
+		uint64_t start = simMicros();
+		chip.receive(frame, sizeof(frame));
+		unsigned long lastByteMs = (unsigned long) ((start + sizeof(frame) * chip.charMicros()) / 1000);
+
+		delay(serviceDelayMs[ii]);
+		for(int jj = 0; jj < 200 && !port.frameAvailable(); jj++) {
+			delay(1);
+		}
+
+		uint8_t buf[64];
+		unsigned long timestamp = 0;
+		EXPECT_EQ(port.readFrame(buf, sizeof(buf), &timestamp), sizeof(frame));
+		EXPECT(memcmp(buf, frame, sizeof(frame)) == 0);
+		EXPECT((long) (timestamp - lastByteMs) >= -1 && (long) (timestamp - lastByteMs) <= 1);
+	}
+}
+
+static void testSpiTransport() {
+	SC16IS740Sim chip;
+	chip.withSPI(SPI, A2);
+	SC16IS740SPI port(SPI, A2);
+
+	EXPECT(port.begin(115200));
+	EXPECT_EQ(chip.baud(), 115200);
+	EXPECT_EQ(SPI.clockHz, 4 * MHZ);
+
+	std::string msg(64, 'S');
+	EXPECT_EQ(port.write((const uint8_t *)msg.data(), msg.size()), msg.size());
+	EXPECT(port.flush(1000));
+	EXPECT(sentString(chip) == msg);
+	// SPI has no transaction size limit, so the whole FIFO is written at once
+	EXPECT_EQ(port.getStats().bulkWrites, 1);
+
+	std::string in(64, 'R');
+	chip.receive(in.c_str());
+	delay(10);
+	uint8_t buf[64];
+	EXPECT_EQ(port.read(buf, sizeof(buf)), 64);
+	EXPECT_EQ(port.getStats().bulkReads, 1);
+}
+
+// Moves the same data through a port, for comparing SC16IS740T with the virtual classes
+template<class Port>
+static SC16IS740Stats transportWorkload(Port &port, SC16IS740Sim &chip) {
+	EXPECT(port.begin(115200));
+
+	std::string in = "The quick brown fox jumps over the lazy dog, 0123456789";
+	chip.receive(in.c_str());
+	delay(10);
+	char buf[64];
+	EXPECT_EQ(port.readBytes(buf, in.size()), in.size());
+	EXPECT(memcmp(buf, in.data(), in.size()) == 0);
+
+	std::string out(100, 'T');
+	EXPECT_EQ(port.write((const uint8_t *)out.data(), out.size()), out.size());
+	EXPECT(port.flush(1000));
+	EXPECT(sentString(chip) == out);
+
+	return port.getStats();
+}
+
+static void testCompileTimeTransport() {
+	// Wire buffers enlarged as with acquireWireBuffer()
+	Wire.bufferSize = 65;
+
+	SC16IS740Stats virtualStats;
+	{
+		SC16IS740Sim chip;
+		chip.withI2C(Wire, I2C_ADDR);
+		SC16IS740 port(Wire, 0);
+		port.withI2CBufferSize(65);
+		virtualStats = transportWorkload(port, chip);
+	}
+
+	// Same transactions as SC16IS740 with the same limits
+	{
+		SC16IS740Sim chip;
+		chip.withI2C(Wire, I2C_ADDR);
+		SC16IS740T<SC16IS740I2CTransport> port(Wire, 0);
+		port.getTransport().withBufferSize(65);
+		SC16IS740Stats stats = transportWorkload(port, chip);
+		EXPECT_EQ(stats.registerReads, virtualStats.registerReads);
+		EXPECT_EQ(stats.registerWrites, virtualStats.registerWrites);
+		EXPECT_EQ(stats.bulkReads, virtualStats.bulkReads);
+		EXPECT_EQ(stats.bulkWrites, virtualStats.bulkWrites);
+		EXPECT_EQ(stats.bulkReads, 1);
+		EXPECT_EQ(stats.bulkWrites, 2);
+	}
+
+	// Buffered and scheduled, using the SPI transport with DMA
+	SC16IS740Sim chip;
+	chip.withSPI(SPI, A2).withIrqPin(A1);
+	SC16IS740Buffered<SC16IS740T<SC16IS740SPITransport>, 256, 256> port(SPI, A2);
+	port.withInterruptPin(A1);
+	port.getTransport().withDma().withSpiClockSpeedMHz(8);
+
+	SC16IS740Scheduler scheduler;
+	EXPECT(scheduler.addPort(port));
+	EXPECT(port.begin(115200));
+	EXPECT_EQ(SPI.clockHz, 8 * MHZ);
+
+	uint8_t data[200];
+	for(size_t ii = 0; ii < sizeof(data); ii++) {
+		data[ii] = (uint8_t) ii;
+	}
+	EXPECT_EQ(port.write(data, sizeof(data)), sizeof(data));
+	chip.receive("hello world");
+	for(int ii = 0; ii < 100 && chip.sent.size() < sizeof(data); ii++) {
+		scheduler.loop();
+		delay(1);
+	}
+	EXPECT_EQ(chip.sent.size(), sizeof(data));
+	EXPECT(memcmp(chip.sent.data(), data, sizeof(data)) == 0);
+	EXPECT_EQ(chip.counters.txOverruns, 0);
+
+	char buf[32];
+	EXPECT_EQ(port.read((uint8_t *)buf, sizeof(buf)), 11);
+	EXPECT(memcmp(buf, "hello world", 11) == 0);
+	EXPECT_EQ(port.getStats().bulkReads, 1);
+}
+
+static void testDmaAsyncWaitsPerBus() {
+	SC16IS740Sim chipA, chipB;
+	chipA.withSPI(SPI, A1);
+	chipB.withSPI(SPI, A2);
+	SC16IS740SPI portA(SPI, A1);
+	SC16IS740SPI portB(SPI, A2);
+	portA.withDma();
+	portB.withDma();
+	EXPECT(portA.begin(115200));
+	EXPECT(portB.begin(115200));
+
+	SPI.deferDmaCompletion = true;
+	EXPECT(portA.writeAsync((const uint8_t *)"async", 5));
+	EXPECT(portA.isDmaBusy());
+	SPI.deferDmaCompletion = false;
+
+	// Finish the transfer from another thread, as the DMA interrupt would
+	std::thread completion([]() {
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		SPI.completeDma();
+	});
+
+	// portB must not assert its CS while portA's transfer still has the bus
+	uint8_t buf[8];
+	portB.read(buf, sizeof(buf));
+	completion.join();
+
+	EXPECT(!portA.isDmaBusy());
+	EXPECT_EQ(SPI.selectConflicts, 0);
+	EXPECT(portA.flush(1000));
+	EXPECT(sentString(chipA) == "async");
+}
+
+static void testDmaAsyncUpdatesTxCredit() {
+	SC16IS740Sim chip;
+	chip.withSPI(SPI, A2);
+	SC16IS740SPI port(SPI, A2);
+	port.withDma();
+	EXPECT(port.begin(9600));
+
+	std::string a(60, 'a');
+	std::string b(60, 'b');
+	EXPECT(port.writeAsync((const uint8_t *)a.data(), a.size()));
+
+	// The FIFO only has room for a few more bytes, so this must wait for it to drain
+	EXPECT_EQ(port.write((const uint8_t *)b.data(), b.size()), b.size());
+	EXPECT(port.flush(1000));
+	EXPECT_EQ(chip.counters.txOverruns, 0);
+	EXPECT(sentString(chip) == a + b);
+}
+
+static void testSharedBusCacheIsOptIn() {
+	SC16IS740Sim chip;
+	chip.withSPI(SPI, A2);
+	SC16IS740SPI port(SPI, A2);
+	port.withSharedBus(200);
+	EXPECT(port.begin(115200));
+
+	// Without the cache every transaction reapplies the settings, as other code may have changed them
+	uint32_t changes = SPI.settingsChanges;
+	port.availableForWrite();
+	port.availableForWrite();
+	EXPECT_EQ(SPI.settingsChanges - changes, 6);
+
+	// With the cache, only when they differ from the last settings this library applied
+	port.withSharedBusCache();
+	port.availableForWrite();
+	changes = SPI.settingsChanges;
+	port.availableForWrite();
+	port.availableForWrite();
+	EXPECT_EQ(SPI.settingsChanges - changes, 0);
+
+	SC16IS740SPI::sharedBusChanged(SPI);
+	port.availableForWrite();
+	EXPECT_EQ(SPI.settingsChanges - changes, 3);
+}
+
+// One bus configuration in the performance sweep
+struct SweepBus {
+	const char *name;
+	bool spi;
+	uint32_t speed; //!< I2C speed or SPI clock in Hz
+};
+
+struct SweepResult {
+	uint64_t elapsed; //!< Microseconds of simulated time
+	uint64_t busMicros; //!< Microseconds the bus spent on transactions to the chip
+	uint32_t transactions;
+};
+
+static const SweepBus sweepBuses[] = {
+	{ "i2c", false, CLOCK_SPEED_100KHZ },
+	{ "i2c", false, CLOCK_SPEED_400KHZ },
+	{ "i2c", false, 1000000 },
+	{ "spi", true, 1 * MHZ },
+	{ "spi", true, 4 * MHZ },
+	{ "spi", true, 8 * MHZ },
+	{ "spi", true, 15 * MHZ },
+};
+
+static const int sweepBauds[] = { 1200, 9600, 57600, 115200 };
+
+static const size_t sweepChunks[] = { 1, 8, 16, 32, 64 };
+
+static const size_t SWEEP_BYTES = 256;
+
+static const size_t SWEEP_LATENCY_SAMPLES = 100;
+
+// Call after simReset() and constructing the chip and both ports, so the chip starts at time 0
+static SC16IS740Base *sweepBegin(const SweepBus &bus, int baud, SC16IS740Sim &chip, SC16IS740 &i2cPort, SC16IS740SPI &spiPort) {
+	SC16IS740Base *port;
+	if (bus.spi) {
+		chip.withSPI(SPI, A2);
+		spiPort.withSpiClockSpeedMHz(bus.speed / MHZ);
+		port = &spiPort;
+	}
+	else {
+		chip.withI2C(Wire, I2C_ADDR);
+		Wire.setSpeed(bus.speed);
+		port = &i2cPort;
+	}
+	port->begin(baud);
+	chip.counters = SC16IS740Sim::Counters();
+	return port;
+}
+
+static SweepResult sweepResult(const SC16IS740Sim &chip, uint64_t start) {
+	SweepResult result;
+	result.elapsed = simMicros() - start;
+	result.busMicros = chip.counters.busNanos / 1000;
+	result.transactions = chip.counters.transactions;
+	return result;
+}
+
+// Blocking writes of chunk bytes at a time, then flush()
+static SweepResult sweepTransmit(const SweepBus &bus, int baud, size_t chunk) {
+	simReset();
+	SC16IS740Sim chip;
+	SC16IS740 i2cPort(Wire, 0);
+	SC16IS740SPI spiPort(SPI, A2);
+	SC16IS740Base *port = sweepBegin(bus, baud, chip, i2cPort, spiPort);
+
+	uint8_t data[SWEEP_BYTES];
+	for(size_t ii = 0; ii < sizeof(data); ii++) {
+		data[ii] = (uint8_t) ii;
+	}
+
+	uint64_t start = simMicros();
+	for(size_t ii = 0; ii < sizeof(data); ii += chunk) {
+		EXPECT_EQ(port->write(&data[ii], chunk), chunk);
+	}
+	EXPECT(port->flush(60000));
+	SweepResult result = sweepResult(chip, start);
+
+	EXPECT(chip.sent.size() == sizeof(data) && memcmp(chip.sent.data(), data, sizeof(data)) == 0);
+	EXPECT_EQ(chip.counters.txOverruns, 0);
+	return result;
+}
+
+// Data arriving back-to-back at the line rate, read with readBytes()
+static SweepResult sweepReceive(const SweepBus &bus, int baud) {
+	simReset();
+	SC16IS740Sim chip;
+	SC16IS740 i2cPort(Wire, 0);
+	SC16IS740SPI spiPort(SPI, A2);
+	SC16IS740Base *port = sweepBegin(bus, baud, chip, i2cPort, spiPort);
+
+	uint8_t data[SWEEP_BYTES];
+	for(size_t ii = 0; ii < sizeof(data); ii++) {
+		data[ii] = (uint8_t) ii;
+	}
+	port->setTimeout(1000);
+	chip.receive(data, sizeof(data));
+
+	uint64_t start = simMicros();
+	uint8_t buf[SWEEP_BYTES];
+	EXPECT_EQ(port->readBytes((char *)buf, sizeof(buf)), sizeof(buf));
+	SweepResult result = sweepResult(chip, start);
+
+	EXPECT(memcmp(buf, data, sizeof(data)) == 0);
+	EXPECT_EQ(chip.counters.rxOverruns, 0);
+	return result;
+}
+
+// Time from write() of one byte on an idle line until its stop bit leaves the TX pin. Returns
+// the p50 and p99 latency in microseconds.
+static void sweepLatency(const SweepBus &bus, int baud, unsigned long &p50, unsigned long &p99) {
+	simReset();
+	SC16IS740Sim chip;
+	SC16IS740 i2cPort(Wire, 0);
+	SC16IS740SPI spiPort(SPI, A2);
+	SC16IS740Base *port = sweepBegin(bus, baud, chip, i2cPort, spiPort);
+
+	unsigned long samples[SWEEP_LATENCY_SAMPLES];
+	for(size_t ii = 0; ii < SWEEP_LATENCY_SAMPLES; ii++) {
+		EXPECT(port->flush(1000));
+		delayMicroseconds(ii * 7 % chip.charMicros());
+
+		uint64_t busBefore = chip.counters.busNanos;
+		uint64_t start = simMicros();
+		port->write((uint8_t) ii);
+		uint64_t busNanos = chip.counters.busNanos - busBefore;
+		while(chip.sent.size() < ii + 1) {
+			delayMicroseconds(1);
+		}
+		samples[ii] = (unsigned long) (simMicros() - start);
+
+		// The write transaction, then one character time on the wire
+		EXPECT(samples[ii] <= busNanos / 1000 + chip.charMicros() + 5);
+	}
+
+	std::sort(samples, samples + SWEEP_LATENCY_SAMPLES);
+	p50 = samples[SWEEP_LATENCY_SAMPLES / 2];
+	p99 = samples[(SWEEP_LATENCY_SAMPLES * 99 + 99) / 100 - 1];
+}
+
+static void testPerformanceSweep() {
+	// Throughput, bus cost, and latency across baud rate, bus speed, and write chunk size. The
+	// bounds are regression limits: a change that adds transactions or leaves the line idle fails.
+	for(size_t bb = 0; bb < sizeof(sweepBuses) / sizeof(sweepBuses[0]); bb++) {
+		const SweepBus &bus = sweepBuses[bb];
+		size_t readMax = bus.spi ? 64 : 32;
+		size_t writeMax = bus.spi ? 64 : 31;
+		// An I2C read is a write of the register address and then the read
+		size_t perRead = bus.spi ? 1 : 2;
+
+		for(size_t rr = 0; rr < sizeof(sweepBauds) / sizeof(sweepBauds[0]); rr++) {
+			int baud = sweepBauds[rr];
+			uint64_t charMicros = (uint64_t) 10 * 1000000 / baud;
+			uint64_t wireMicros = SWEEP_BYTES * charMicros;
+
+			for(size_t cc = 0; cc < sizeof(sweepChunks) / sizeof(sweepChunks[0]); cc++) {
+				size_t chunk = sweepChunks[cc];
+				SweepResult tx = sweepTransmit(bus, baud, chunk);
+				printf("     tx %s %8lu baud=%6d chunk=%2u %8lu us bus=%6lu us transactions=%5u\n", bus.name, (unsigned long) bus.speed, baud,
+					(unsigned) chunk, (unsigned long) tx.elapsed, (unsigned long) tx.busMicros, (unsigned) tx.transactions);
+
+				// The line stays busy unless the bus is the bottleneck
+				uint64_t bound = (wireMicros > tx.busMicros) ? wireMicros : tx.busMicros;
+				EXPECT(tx.elapsed <= bound * 6 / 5 + 4 * charMicros);
+
+				// Each chunk is one FIFO write, plus TXLVL reads while blocked and LSR polls in flush()
+				size_t perWrite = (chunk < writeMax) ? chunk : writeMax;
+				size_t writes = (SWEEP_BYTES + perWrite - 1) / perWrite;
+				EXPECT(tx.transactions <= writes + perRead * (writes * 3 / 2 + 24));
+			}
+
+			// 100 kHz I2C can't move data as fast as 115200 baud delivers it
+			if (bus.spi || bus.speed / 9 >= (uint32_t) baud / 10 * 5 / 4) {
+				SweepResult rx = sweepReceive(bus, baud);
+				printf("     rx %s %8lu baud=%6d          %8lu us bus=%6lu us transactions=%5u\n", bus.name, (unsigned long) bus.speed, baud,
+					(unsigned long) rx.elapsed, (unsigned long) rx.busMicros, (unsigned) rx.transactions);
+
+				// Finishes within one poll interval of the last byte arriving
+				EXPECT(rx.elapsed <= wireMicros + SC16IS740Base::RX_POLL_MAX_CHARS * charMicros + rx.busMicros);
+
+				// A poll every readInternalMax() or RX_POLL_MAX_CHARS characters, each reading RXLVL and the FIFO
+				size_t perPoll = readMax;
+				if (perPoll > SC16IS740Base::RX_POLL_MAX_CHARS) {
+					perPoll = SC16IS740Base::RX_POLL_MAX_CHARS;
+				}
+				EXPECT(rx.transactions <= perRead * (3 * (SWEEP_BYTES / perPoll) + 12));
+			}
+
+			unsigned long p50, p99;
+			sweepLatency(bus, baud, p50, p99);
+			printf("     latency %s %8lu baud=%6d p50=%lu us p99=%lu us\n", bus.name, (unsigned long) bus.speed, baud, p50, p99);
+		}
+	}
+}
+
+int main() {
+	runTest("begin programs the chip", testBeginProgramsChip);
+	runTest("setBaud writes only changes", testSetBaudWritesOnlyChanges);
+	runTest("write and flush", testWriteAndFlush);
+	runTest("bulk read", testBulkRead);
+	runTest("transfer limit override", testTransferLimitOverride);
+	runTest("readBytes timeout", testReadBytesTimeout);
+	runTest("readBytes keeps up with the line", testReadBytesKeepsUp);
+	runTest("RS-485 with flow control", testRS485WithFlowControl);
+	runTest("transmit queue", testTxQueue);
+	runTest("writev", testWritev);
+	runTest("writev stops at a short write", testWritevShortWriteStops);
+	runTest("scheduler with interrupt pin", testSchedulerWithInterruptPin);
+	runTest("scheduler idles when receive buffer is full", testSchedulerIdlesWhenRxBufferFull);
+	runTest("managed flush without worker thread", testManagedFlushWithoutThread);
+	runTest("managed blocking write without worker thread", testManagedBlockingWriteWithoutThread);
+	runTest("worker thread callbacks", testWorkerThreadCallbacks);
+	runTest("loopback test", testLoopback);
+	runTest("frame mode", testFrameMode);
+	runTest("frame timestamp from interrupt", testFrameTimestampFromInterrupt);
+	runTest("frame timestamp above the trigger level", testFrameTimestampAboveTriggerLevel);
+	runTest("SPI transport", testSpiTransport);
+	runTest("compile-time transport", testCompileTimeTransport);
+	runTest("asynchronous DMA waits per bus", testDmaAsyncWaitsPerBus);
+	runTest("asynchronous DMA updates TX FIFO space", testDmaAsyncUpdatesTxCredit);
+	runTest("shared bus cache is opt-in", testSharedBusCacheIsOptIn);
+	runTest("performance sweep", testPerformanceSweep);
+
+	printf("%d tests, %d failed\n", testsRun, testsFailed);
+	return testsFailed ? 1 : 0;
+}